@@ -0,0 +1,116 @@
+// SPDX-FileCopyrightText: 2023 Andreas Sig Rosvall
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+#include <compiler.h>
+#include <stdint.h>
+#include "flash.h"
+#include "prof.h"
+
+/*
+ * Code banking for parts with more than 32 KB flash.
+ *
+ * The CPU sees the root bank (flash 0x00000-0x07FFF) at code 0x0000-0x7FFF and
+ * one more 32 KB bank, selected by FMAP, at code 0x8000-0xFFFF. (MEMCTR.XBANK
+ * only selects which bank is visible in xdata, see mmap_code_to_xdata().)
+ *
+ * SDCC calls functions declared __banked (or all functions with --model-huge)
+ * through __sdcc_banked_call with the target address in R0 (low), R1 (high) and
+ * the bank number in R2, and such functions return through __sdcc_banked_ret.
+ * Define BANK_DEFINE_TRAMPOLINES in exactly one translation unit before including
+ * this file to get implementations of these that switch FMAP.
+ *
+ * A cross-bank call costs 9 instructions on top of a plain call (lcall, 3 pushes
+ * of the target and saved bank, 2 xch, 2 mov, ret), and the return 2 more (pop,
+ * ret) plus the ljmp to __sdcc_banked_ret. bank_measure_call() measures what
+ * that is in cycles with the profiler timer (see prof.h). Define BANK_COUNT_CALLS
+ * to count banked calls in bank_calls; bank_overhead_cycles() then gives the
+ * cycles spent on banking, to find call paths worth moving to the root bank.
+ *
+ * Hot routines (ISRs, and anything they call) must be in the root bank: mark them
+ * BANK_ROOT and list their modules with --hot for tools/bank_alloc.py, which
+ * assigns the remaining modules to banks and generates the linker options.
+ */
+
+#define BANK_COUNT 8
+
+#define BANK_ROOT   __nonbanked
+#define BANK_CALLED __banked
+
+// Code address of the bank window
+#define BANK_WINDOW 0x8000u
+
+// Bank currently mapped at code 0x8000-0xFFFF
+#define bank_current() (FMAP & FMAP_MAP__MASK)
+
+#ifndef BANK_MEASURE_CALLS
+#define BANK_MEASURE_CALLS 16
+#endif
+
+// Cycles a cross-bank call and return add to a plain call, into _cycles.
+// _banked and _root are empty functions, one __banked in a switched bank and
+// one in the root bank. Averaged over BANK_MEASURE_CALLS calls of each; the
+// profiler must be running (prof_init()).
+#define bank_measure_call(_p, _cycles, _banked, _root)                         \
+	do {                                                                       \
+		uint32_t _t0, _t1, _t2;                                                \
+		uint8_t _i;                                                            \
+		_t0 = prof_now(_p);                                                    \
+		for (_i = 0; _i < BANK_MEASURE_CALLS; _i++)                            \
+			_banked();                                                         \
+		_t1 = prof_now(_p);                                                    \
+		for (_i = 0; _i < BANK_MEASURE_CALLS; _i++)                            \
+			_root();                                                           \
+		_t2 = prof_now(_p);                                                    \
+		_t0 = prof_elapsed(_t0, _t1) - prof_elapsed(_t1, _t2);                 \
+		(_cycles) = prof_cycles(_t0) / BANK_MEASURE_CALLS;                     \
+	} while (0)
+
+#ifdef BANK_COUNT_CALLS
+#ifdef BANK_DEFINE_TRAMPOLINES
+__data volatile uint16_t bank_calls;
+#else
+extern __data volatile uint16_t bank_calls;
+#endif
+
+// Cycles spent on banking since bank_calls was cleared, with the per-call cost
+// from bank_measure_call()
+#define bank_overhead_cycles(_per_call) ((uint32_t)bank_calls * (_per_call))
+#endif
+
+#ifdef BANK_DEFINE_TRAMPOLINES
+
+// Called with the target in R2:R1:R0. Does not assume any register bank.
+void
+__sdcc_banked_call(void) __naked
+{
+	__asm
+	push	_FMAP           ; bank to return to
+	xch	a,r0            ; save acc in r0
+	push	acc             ; target address, low byte
+	mov	a,r1
+	push	acc             ; target address, high byte
+#ifdef BANK_COUNT_CALLS
+	inc	_bank_calls
+	mov	a,_bank_calls
+	jnz	00001$
+	inc	(_bank_calls + 1)
+00001$:
+#endif
+	mov	_FMAP,r2        ; select the target bank
+	xch	a,r0            ; restore acc
+	ret                     ; "return" to the target
+	__endasm;
+}
+
+void
+__sdcc_banked_ret(void) __naked
+{
+	__asm
+	pop	_FMAP           ; restore the bank of the caller
+	ret
+	__endasm;
+}
+
+#endif
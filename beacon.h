@@ -0,0 +1,215 @@
+// SPDX-FileCopyrightText: 2023 Andreas Sig Rosvall
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+#include <compiler.h>
+#include <stdint.h>
+#include "bits.h"
+#include "csp.h"
+#include "dma.h"
+#include "mac_timer.h"
+#include "mem.h"
+
+/*
+ * Hardware-timed beacons for beacon-enabled 802.15.4 networks.
+ *
+ * Transmitter: the MAC timer runs with the backoff period (the default
+ * MAC_TIMER_PERIOD), and overflow compare 1 is set to the backoff period in
+ * which the next beacon goes out. Its event pulse (T2EVTCFG event 1) triggers a
+ * DMA channel that writes an immediate STXON strobe to RFST, so the beacon
+ * already waiting in the TX FIFO is sent exactly on the backoff boundary,
+ * whatever the CPU is doing. The CPU only has to move the compare to the next
+ * beacon and refresh the frame at some point during the beacon interval:
+ *
+ *   beacon_tx_start(&btx, &dma_conf[1], 1, BO, first);
+ *   ...
+ *   // after each beacon (e.g. on the TX done interrupt)
+ *   beacon_tx_next(&btx);
+ *
+ * Receiver: the MAC timer captures the time of every SFD. After receiving a
+ * beacon, beacon_track_rx() takes the capture as the beacon time and keeps a
+ * running estimate of the clock drift to the coordinator, and
+ * beacon_track_wake() gives the time to turn RX on for the next beacon with a
+ * guard time that grows only with missed beacons, so end devices can sleep
+ * until just before each beacon.
+ */
+
+// aBaseSuperframeDuration is 960 symbols, i.e. 48 backoff periods
+#define BEACON_BASE_PERIODS 48ul
+#define BEACON_INTERVAL_PERIODS(_bo) (BEACON_BASE_PERIODS << (_bo))
+
+_Static_assert(MAC_TIMER_PERIOD == MAC_TIMER_BACKOFF_PERIOD,
+               "beacon timing counts MAC timer periods as backoff periods");
+
+// xdata address of RFST, for DMA
+#define BEACON_RFST_XADDR (SFR_MAPPING_IN_XDATA + 0xE1)
+
+struct beacon_tx {
+	uint32_t next;                 // Backoff period (overflow count) of the next beacon
+	uint32_t interval;             // Backoff periods between beacons
+	uint8_t strobe;                // CSP_IMM_CMD_STROBE(CSP_CMD_TXON), the DMA source
+};
+
+// Set overflow compare 1
+inline void
+beacon_set_ovf_cmp1(uint32_t ovf)
+{
+	uint8_t ea = IEN0_EA;
+	uint8_t sel;
+
+	IEN0_EA = 0;
+	sel = T2MSEL;
+	mac_timer_select_multiplexed_regs(T2M_CMP1, T2OVF_CMP1);
+	T2MOVF0 = ovf;
+	T2MOVF1 = ovf >> 8;
+	T2MOVF2 = ovf >> 16;
+	T2MSEL = sel;
+	IEN0_EA = ea;
+}
+
+// Send beacons every 2^bo superframes, the first in backoff period first.
+// The beacon frame must be in the TX FIFO. conf must be the configuration of
+// DMA channel ch. Uses overflow compare 1 and its event pulse.
+inline void
+beacon_tx_start(struct beacon_tx __xdata * btx, struct dma_conf __xdata * conf, uint8_t ch,
+                uint8_t bo, uint32_t first)
+{
+	btx->interval = BEACON_INTERVAL_PERIODS(bo);
+	btx->next = first & MAC_TIMER_OVF_MASK;
+	btx->strobe = CSP_IMM_CMD_STROBE(CSP_CMD_TXON);
+
+	conf->src = SWAP16((uint16_t)&btx->strobe);
+	conf->dst = SWAP16(BEACON_RFST_XADDR);
+	conf->len = DMA_LEN(1, FIXED);
+	conf->mode1 = DMA_MODE1(TRIG_T2_EVENT1, BYTEMODE, REPEAT, WORD8);
+	conf->mode2 = DMA_MODE2(PRIORITY_HIGH, NO_MASK8, INTR_DISABLE, SRC_CONST, DST_CONST);
+
+	beacon_set_ovf_cmp1(btx->next);
+	mac_timer_setup_event_pulses(OVF_CMP1, NONE);
+	dma_arm(ch);
+}
+
+// Move to the next beacon. Call once per beacon, after it has been sent, and
+// refresh the frame in the TX FIFO before the next one is due.
+inline void
+beacon_tx_next(struct beacon_tx __xdata * btx)
+{
+	btx->next = (btx->next + btx->interval) & MAC_TIMER_OVF_MASK;
+	beacon_set_ovf_cmp1(btx->next);
+}
+
+// Beacon tracking on the receiver
+
+// Time from turning RX on to being able to receive the SFD: 12 symbols of RX
+// turnaround, then the 5 byte synchronisation header of the beacon.
+#define BEACON_RX_LEAD ((12u + 10u) * MAC_TIMER_SYMBOL_TICKS)
+
+#ifndef BEACON_GUARD_TICKS
+#define BEACON_GUARD_TICKS (4u * MAC_TIMER_SYMBOL_TICKS)
+#endif
+
+struct beacon_track {
+	struct mac_timer_time last;    // SFD of the last beacon received
+	uint32_t interval;             // Nominal interval in backoff periods
+	int16_t drift;                 // Average interval error in ticks
+	uint8_t missed;                // Beacons missed since the last one received
+	uint8_t locked;
+};
+
+inline void
+beacon_track_init(struct beacon_track __xdata * trk, uint8_t bo)
+{
+	trk->interval = BEACON_INTERVAL_PERIODS(bo);
+	trk->drift = 0;
+	trk->missed = 0;
+	trk->locked = 0;
+}
+
+// Time of the last SFD, as captured by the MAC timer
+inline void
+beacon_sfd_capture(struct mac_timer_time * t)
+{
+	uint8_t ea = IEN0_EA;
+	uint8_t sel, l, o0, o1;
+
+	IEN0_EA = 0;
+	sel = T2MSEL;
+	mac_timer_select_multiplexed_regs(T2M_CAPTURE, T2OVF_CAPTURE);
+	l = T2M0;
+	t->tim = ((uint16_t)T2M1 << 8) | l;
+	o0 = T2MOVF0;
+	o1 = T2MOVF1;
+	t->ovf = ((uint32_t)T2MOVF2 << 16) | ((uint16_t)o1 << 8) | o0;
+	T2MSEL = sel;
+	IEN0_EA = ea;
+}
+
+// t + periods + ticks, where ticks may be negative.
+// Long beacon intervals do not fit mac_timer_add() or mac_timer_diff() in ticks.
+inline void
+beacon_time_offset(struct mac_timer_time * t, uint32_t periods, int32_t ticks)
+{
+	int32_t p = ticks / (int32_t)MAC_TIMER_PERIOD;
+	int32_t r = ticks - p * (int32_t)MAC_TIMER_PERIOD;
+
+	if (r < 0) {
+		r += MAC_TIMER_PERIOD;
+		p--;
+	}
+	t->ovf = (t->ovf + periods + p) & MAC_TIMER_OVF_MASK;
+	mac_timer_add(t, r);
+}
+
+// Call after receiving a beacon (before another frame can start).
+inline void
+beacon_track_rx(struct beacon_track __xdata * trk)
+{
+	struct mac_timer_time sfd;
+	uint8_t n = trk->missed + 1;
+	int32_t err;
+
+	beacon_sfd_capture(&sfd);
+
+	if (trk->locked) {
+		// Error against the nominal time, per interval
+		err = (int32_t)(((sfd.ovf - trk->last.ovf - trk->interval * n) & MAC_TIMER_OVF_MASK) << 8) >> 8;
+		err = err * (int32_t)MAC_TIMER_PERIOD + (int32_t)sfd.tim - trk->last.tim;
+		err /= n;
+		if (err > -0x4000 && err < 0x4000)
+			trk->drift += ((int16_t)err - trk->drift) / 4;
+	}
+	trk->last = sfd;
+	trk->missed = 0;
+	trk->locked = 1;
+}
+
+// Call when the receive window for a beacon closed without one
+#define beacon_track_miss(_trk)                                                \
+	do {                                                                       \
+		if ((_trk)->missed < 0xFE)                                             \
+			(_trk)->missed++;                                                  \
+	} while (0)
+
+// Predicted SFD time of the next beacon
+inline void
+beacon_track_next(struct beacon_track __xdata * trk, struct mac_timer_time * t)
+{
+	uint8_t n = trk->missed + 1;
+
+	*t = trk->last;
+	beacon_time_offset(t, trk->interval * n, (int32_t)trk->drift * n);
+}
+
+// When to turn RX on for the next beacon. The guard time grows with each
+// missed beacon, since the drift estimate is applied over a longer time.
+inline void
+beacon_track_wake(struct beacon_track __xdata * trk, struct mac_timer_time * t)
+{
+	uint8_t n = trk->missed + 1;
+	int16_t drift = trk->drift < 0 ? -trk->drift : trk->drift;
+	int32_t lead = BEACON_RX_LEAD + ((int32_t)BEACON_GUARD_TICKS + drift) * n;
+
+	*t = trk->last;
+	beacon_time_offset(t, trk->interval * n, (int32_t)trk->drift * n - lead);
+}
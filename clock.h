@@ -4,6 +4,7 @@
 
 #pragma once
 #include <compiler.h>
+#include "bits.h"
 
 // Clock Control Command
 // ### CLKCONCMD (0xC6) - Clock Control Command
@@ -12,6 +13,7 @@ SFR(CLKCONCMD, 0xC6);
 // CLKCONCMD_CLKSPD (Reset=001 R/W) Clock speed.
 // Cannot be higher than system clock setting given by the OSC bit
 // setting. Indicates current system-clock frequency
+#define MASK_CLKCONCMD_CLKSPD BITMASK(3, 0)
 enum CLK_CLKSPD {
 	CLK_CLKSPD_32M  = (0u << 0),
 	CLK_CLKSPD_16M  = (1u << 0),
@@ -36,6 +38,7 @@ enum CLK_CLKSPD {
 // Note that CLKCONCMD.TICKSPD can be set to any value, but the effect is
 // limited by the CLKCONCMD.OSC setting; that is, if CLKCONCMD.OSC = 1 and
 // CLKCONCMD.TICKSPD = 000, CLKCONSTA.TICKSPD reads 001, and the real TICKSPD is 16 MHz.
+#define MASK_CLKCONCMD_TICKSPD BITMASK(3, 3)
 enum CLK_TICKSPD {
 	CLK_TICKSPD_32M  = (0u << 3),
 	CLK_TICKSPD_16M  = (1u << 3),
@@ -0,0 +1,179 @@
+// SPDX-FileCopyrightText: 2023 Andreas Sig Rosvall
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+#include <compiler.h>
+#include <stdint.h>
+#include "bits.h"
+#include "clock.h"
+#include "timer1.h"
+#include "timer4.h"
+#include "usart.h"
+
+/*
+ * Compile-time clock configuration.
+ *
+ * The clock setup is given once, with the same names clk_setup() takes, and
+ * the resulting frequencies and the constants that depend on them are derived
+ * by the preprocessor, so they cannot disagree with what clock_setup() writes:
+ *
+ *   // Before including: the defaults are 32 MHz crystal, no division
+ *   #define CLOCK_CLKSPD  CLKSPD_8M
+ *   #define CLOCK_TICKSPD TICKSPD_8M
+ *   #include "clock_config.h"
+ *
+ *   clock_setup();
+ *   clock_usart_set_baudrate(0, 115200);
+ *   T1CC0 = CLOCK_TICKS_US(1000, 8) - 1;   // 1 ms with DIV8
+ *
+ * CLKSPD and TICKSPD are limited by the oscillator, as in CLKCONSTA, so e.g.
+ * CLKSPD_32M on the 16 MHz RC oscillator gives a 16 MHz CPU clock.
+ */
+
+#ifndef CLOCK_CLKSPD
+#define CLOCK_CLKSPD  CLKSPD_32M
+#endif
+#ifndef CLOCK_TICKSPD
+#define CLOCK_TICKSPD TICKSPD_32M
+#endif
+#ifndef CLOCK_OSC
+#define CLOCK_OSC     OSC_32MHZ_XTAL
+#endif
+#ifndef CLOCK_OSC32K
+#define CLOCK_OSC32K  OSC32K_XTAL
+#endif
+
+#define CLOCK_HZ_CLKSPD_32M    32000000ul
+#define CLOCK_HZ_CLKSPD_16M    16000000ul
+#define CLOCK_HZ_CLKSPD_8M      8000000ul
+#define CLOCK_HZ_CLKSPD_4M      4000000ul
+#define CLOCK_HZ_CLKSPD_2M      2000000ul
+#define CLOCK_HZ_CLKSPD_1M      1000000ul
+#define CLOCK_HZ_CLKSPD_500K     500000ul
+#define CLOCK_HZ_CLKSPD_250K     250000ul
+#define CLOCK_HZ_TICKSPD_32M   32000000ul
+#define CLOCK_HZ_TICKSPD_16M   16000000ul
+#define CLOCK_HZ_TICKSPD_8M     8000000ul
+#define CLOCK_HZ_TICKSPD_4M     4000000ul
+#define CLOCK_HZ_TICKSPD_2M     2000000ul
+#define CLOCK_HZ_TICKSPD_1M     1000000ul
+#define CLOCK_HZ_TICKSPD_500K    500000ul
+#define CLOCK_HZ_TICKSPD_250K    250000ul
+#define CLOCK_HZ_OSC_32MHZ_XTAL 32000000ul
+#define CLOCK_HZ_OSC_16MHZ_RC   16000000ul
+
+#define CLOCK_HZ_(_x) CLOCK_HZ_##_x
+#define CLOCK_HZ(_x) CLOCK_HZ_(_x)
+#define CLOCK_MIN(_a, _b) ((_a) < (_b) ? (_a) : (_b))
+
+#define CLOCK_OSC_HZ  CLOCK_HZ(CLOCK_OSC)
+#define CLOCK_CPU_HZ  CLOCK_MIN(CLOCK_HZ(CLOCK_CLKSPD), CLOCK_OSC_HZ)
+#define CLOCK_TICK_HZ CLOCK_MIN(CLOCK_HZ(CLOCK_TICKSPD), CLOCK_OSC_HZ)
+
+#define clock_setup_(_clkspd, _tickspd, _osc, _osc32k) clk_setup(_clkspd, _tickspd, _osc, _osc32k)
+#define clock_setup() clock_setup_(CLOCK_CLKSPD, CLOCK_TICKSPD, CLOCK_OSC, CLOCK_OSC32K)
+
+// UART and SPI master baud rate: (256 + BAUD_M) * 2^BAUD_E / 2^28 * F, with
+// F the system clock. F >> (20 - E) is the rate for BAUD_M = 0, and E is the
+// largest exponent for which that does not exceed the wanted rate.
+#define CLOCK_BAUD_BASE(_f, _e) ((_f) >> (20 - (_e)))
+#define CLOCK_BAUD_E_F(_f, _b)                                                 \
+	(CLOCK_BAUD_BASE(_f, 20) <= (_b) ? 20 : CLOCK_BAUD_BASE(_f, 19) <= (_b) ? 19 : \
+	 CLOCK_BAUD_BASE(_f, 18) <= (_b) ? 18 : CLOCK_BAUD_BASE(_f, 17) <= (_b) ? 17 : \
+	 CLOCK_BAUD_BASE(_f, 16) <= (_b) ? 16 : CLOCK_BAUD_BASE(_f, 15) <= (_b) ? 15 : \
+	 CLOCK_BAUD_BASE(_f, 14) <= (_b) ? 14 : CLOCK_BAUD_BASE(_f, 13) <= (_b) ? 13 : \
+	 CLOCK_BAUD_BASE(_f, 12) <= (_b) ? 12 : CLOCK_BAUD_BASE(_f, 11) <= (_b) ? 11 : \
+	 CLOCK_BAUD_BASE(_f, 10) <= (_b) ? 10 : CLOCK_BAUD_BASE(_f,  9) <= (_b) ?  9 : \
+	 CLOCK_BAUD_BASE(_f,  8) <= (_b) ?  8 : CLOCK_BAUD_BASE(_f,  7) <= (_b) ?  7 : \
+	 CLOCK_BAUD_BASE(_f,  6) <= (_b) ?  6 : CLOCK_BAUD_BASE(_f,  5) <= (_b) ?  5 : \
+	 CLOCK_BAUD_BASE(_f,  4) <= (_b) ?  4 : CLOCK_BAUD_BASE(_f,  3) <= (_b) ?  3 : \
+	 CLOCK_BAUD_BASE(_f,  2) <= (_b) ?  2 : CLOCK_BAUD_BASE(_f,  1) <= (_b) ?  1 : 0)
+#define CLOCK_BAUD_M_F(_f, _b)                                                 \
+	((uint8_t)((256ul * (_b) + CLOCK_BAUD_BASE(_f, CLOCK_BAUD_E_F(_f, _b)) / 2)   \
+	           / CLOCK_BAUD_BASE(_f, CLOCK_BAUD_E_F(_f, _b)) - 256))
+// Rate actually obtained
+#define CLOCK_BAUD_ACTUAL_F(_f, _b)                                            \
+	((256ul + CLOCK_BAUD_M_F(_f, _b)) * CLOCK_BAUD_BASE(_f, CLOCK_BAUD_E_F(_f, _b)) / 256)
+
+#define CLOCK_BAUD_E(_b)      CLOCK_BAUD_E_F(CLOCK_CPU_HZ, _b)
+#define CLOCK_BAUD_M(_b)      CLOCK_BAUD_M_F(CLOCK_CPU_HZ, _b)
+#define CLOCK_BAUD_ACTUAL(_b) CLOCK_BAUD_ACTUAL_F(CLOCK_CPU_HZ, _b)
+
+// Fail the build if baud rate _b is off by more than _permille
+#define CLOCK_ASSERT_BAUD(_b, _permille)                                       \
+	_Static_assert(CLOCK_BAUD_ACTUAL(_b) * 1000ul <= (_b) * (1000ul + (_permille)) \
+	               && CLOCK_BAUD_ACTUAL(_b) * 1000ul >= (_b) * (1000ul - (_permille)), \
+	               "baud rate " #_b " not reachable at this clock speed")
+
+// Like usart_set_baudrate(), for any rate and the configured clock
+#define clock_usart_set_baudrate(_n, _b)                                       \
+	{                                                                          \
+		U##_n##BAUD = CLOCK_BAUD_M(_b);                                        \
+		U##_n##GCR &= ~UXGCR_BAUD_E__MASK;                                     \
+		U##_n##GCR |= CLOCK_BAUD_E(_b);                                        \
+	}
+
+// Timer ticks in _us microseconds with a prescaler of _div, at TICKSPD
+#define CLOCK_TICKS_US(_us, _div)                                              \
+	((uint32_t)(_us) * (CLOCK_TICK_HZ / 1000u) / (1000u * (_div)))
+
+// Smallest Timer 1 prescaler (1, 8, 32, 128) for a 16-bit period of _us
+#define CLOCK_T1_DIV(_us)                                                      \
+	(CLOCK_TICKS_US(_us, 1) <= 0x10000ul ? 1 : CLOCK_TICKS_US(_us, 8) <= 0x10000ul ? 8 : \
+	 CLOCK_TICKS_US(_us, 32) <= 0x10000ul ? 32 : 128)
+// T1CTL.DIV bits for it
+#define CLOCK_T1CTL_DIV(_us)                                                   \
+	(CLOCK_T1_DIV(_us) == 1 ? T1CTL_DIV_DIV1 : CLOCK_T1_DIV(_us) == 8 ? T1CTL_DIV_DIV8 : \
+	 CLOCK_T1_DIV(_us) == 32 ? T1CTL_DIV_DIV32 : T1CTL_DIV_DIV128)
+
+// Smallest Timer 3/4 prescaler shift (divider 2^n) for an 8-bit period of _us
+#define CLOCK_T34_FITS(_us, _n) (CLOCK_TICKS_US(_us, 1u << (_n)) <= 0x100ul)
+#define CLOCK_T34_DIV_SHIFT(_us)                                               \
+	(CLOCK_T34_FITS(_us, 0) ? 0 : CLOCK_T34_FITS(_us, 1) ? 1 : CLOCK_T34_FITS(_us, 2) ? 2 : \
+	 CLOCK_T34_FITS(_us, 3) ? 3 : CLOCK_T34_FITS(_us, 4) ? 4 : CLOCK_T34_FITS(_us, 5) ? 5 : \
+	 CLOCK_T34_FITS(_us, 6) ? 6 : 7)
+// T3CTL/T4CTL.DIV bits for it (the same in both)
+#define CLOCK_T34CTL_DIV(_us)                                                  \
+	(CLOCK_T34_DIV_SHIFT(_us) == 0 ? T4CTL_DIV1 : CLOCK_T34_DIV_SHIFT(_us) == 1 ? T4CTL_DIV2 : \
+	 CLOCK_T34_DIV_SHIFT(_us) == 2 ? T4CTL_DIV4 : CLOCK_T34_DIV_SHIFT(_us) == 3 ? T4CTL_DIV8 : \
+	 CLOCK_T34_DIV_SHIFT(_us) == 4 ? T4CTL_DIV16 : CLOCK_T34_DIV_SHIFT(_us) == 5 ? T4CTL_DIV32 : \
+	 CLOCK_T34_DIV_SHIFT(_us) == 6 ? T4CTL_DIV64 : T4CTL_DIV128)
+
+// The watchdog interval shrinks by the oscillator frequency over the clock
+// speed (see watchdog.h). Intervals in 32 kHz periods, and in microseconds
+// with the configured division.
+#define CLOCK_WDT_FACTOR (CLOCK_OSC_HZ / CLOCK_CPU_HZ)
+#define CLOCK_WDT_PERIODS_1000MS 32768ul
+#define CLOCK_WDT_PERIODS_250MS   8192ul
+#define CLOCK_WDT_PERIODS_15MS     512ul
+#define CLOCK_WDT_PERIODS_2MS       64ul
+#define CLOCK_WDT_US(_interval)                                                \
+	(CLOCK_WDT_PERIODS_##_interval * 1000000ul / 32768u / CLOCK_WDT_FACTOR)
+
+// CPU cycles in _us microseconds
+#define CLOCK_CYCLES_US(_us) ((uint32_t)(_us) * (CLOCK_CPU_HZ / 1000u) / 1000u)
+
+// Cycles per iteration of clock_delay(). Depends on the compiler and its
+// options; calibrate with prof.h when changing either.
+#ifndef CLOCK_DELAY_LOOP_CYCLES
+#define CLOCK_DELAY_LOOP_CYCLES 12u
+#endif
+
+#define CLOCK_DELAY_LOOPS(_us) (CLOCK_CYCLES_US(_us) / CLOCK_DELAY_LOOP_CYCLES)
+
+inline void
+clock_delay(uint16_t loops)
+{
+	while (loops--) {
+		__asm
+		nop
+		__endasm;
+	}
+}
+
+#define clock_delay_us(_us)                                                    \
+	do {                                                                       \
+		_Static_assert(CLOCK_DELAY_LOOPS(_us) <= 0xFFFFu, "delay too long");   \
+		clock_delay(CLOCK_DELAY_LOOPS(_us));                                   \
+	} while (0)
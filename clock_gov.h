@@ -0,0 +1,141 @@
+// SPDX-FileCopyrightText: 2023 Andreas Sig Rosvall
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+#include <compiler.h>
+#include <stdint.h>
+#include "bits.h"
+#include "clock.h"
+#include "interrupts.h"
+#include "usart.h"
+
+/*
+ * Run-time CPU clock scaling.
+ *
+ * The CPU runs at the slow clock speed unless some code holds a boost, e.g.
+ * around radio and AES work:
+ *
+ *   clock_gov_init(&gov, CLK_CLKSPD_32M, CLK_CLKSPD_4M, CLOCK_GOV_USART0);
+ *   ...
+ *   clock_gov_boost(&gov);
+ *   send_frame();
+ *   clock_gov_release(&gov);
+ *
+ * Only CLKCONCMD.CLKSPD changes. TICKSPD stays as set up, so the slow speed
+ * must not be below it; timers, the MAC timer and the sleep timer then keep
+ * their rates. The USART baud rate generators run from the system clock, so
+ * BAUD_E of the USARTs in uarts is adjusted by the change in CLKSPD, after
+ * waiting for each to finish the byte in progress. A byte that starts arriving
+ * during the switch is lost; switch when the link is idle, or use flow control.
+ *
+ * The watchdog interval shrinks with the clock division (see watchdog.h), and
+ * cannot be changed while the watchdog runs: feed it often enough for the
+ * slow speed, see clock_gov_wdt_factor().
+ */
+
+enum clock_gov_usart {
+	CLOCK_GOV_USART0 = BIT(0),
+	CLOCK_GOV_USART1 = BIT(1),
+};
+
+struct clock_gov {
+	uint8_t boost;       // Number of boosts held
+	uint8_t fast;        // CLK_CLKSPD_x while boosted
+	uint8_t slow;        // CLK_CLKSPD_x otherwise
+	uint8_t uarts;       // enum clock_gov_usart
+	uint16_t switches;
+};
+
+// Effective CLKSPD from CLKCONSTA; the RC oscillator limits it to 16 MHz
+#define clock_gov_clkspd() (CLKCONSTA & MASK_CLKCONCMD_CLKSPD)
+
+// Current watchdog interval divisor (1-128)
+inline uint8_t
+clock_gov_wdt_factor(void)
+{
+	uint8_t shift = clock_gov_clkspd();
+
+	// The 16 MHz RC oscillator is the undivided clock, also for CLKSPD 32M
+	if ((CLKCONSTA & CLK_OSC_16MHZ_RC) && shift)
+		shift--;
+	return 1u << shift;
+}
+
+#define clock_gov_rescale_usart(_n, _diff)                                     \
+	do {                                                                       \
+		uint8_t e = (U##_n##GCR & UXGCR_BAUD_E__MASK) + (_diff);               \
+		U##_n##GCR = (U##_n##GCR & ~UXGCR_BAUD_E__MASK) | (e & UXGCR_BAUD_E__MASK); \
+	} while (0)
+
+// Switch to clkspd (CLK_CLKSPD_x), keeping the USART baud rates. Speeds below
+// TICKSPD are raised to it.
+inline void
+clock_gov_set(struct clock_gov __xdata * gov, uint8_t clkspd)
+{
+	uint8_t tickspd = (CLKCONCMD & MASK_CLKCONCMD_TICKSPD) >> 3;
+	uint8_t ea, cur, eff;
+
+	if (clkspd > tickspd)
+		clkspd = tickspd;
+
+	if (gov->uarts & CLOCK_GOV_USART0)
+		while (U0CSR & UXCSR_ACTIVE);
+	if (gov->uarts & CLOCK_GOV_USART1)
+		while (U1CSR & UXCSR_ACTIVE);
+
+	ea = IEN0_EA;
+	IEN0_EA = 0;
+	cur = clock_gov_clkspd();
+	eff = clkspd;
+	if ((CLKCONSTA & CLK_OSC_16MHZ_RC) && eff == CLK_CLKSPD_32M)
+		eff = CLK_CLKSPD_16M;
+	if (eff != cur) {
+		CLKCONCMD = (CLKCONCMD & ~MASK_CLKCONCMD_CLKSPD) | clkspd;
+		while (clock_gov_clkspd() != eff);
+
+		// Each CLKSPD step halves the clock, and doubles the baud rate divisor
+		if (gov->uarts & CLOCK_GOV_USART0)
+			clock_gov_rescale_usart(0, eff - cur);
+		if (gov->uarts & CLOCK_GOV_USART1)
+			clock_gov_rescale_usart(1, eff - cur);
+		gov->switches++;
+	}
+	IEN0_EA = ea;
+}
+
+// The baud rates of the USARTs in uarts must be set for the current clock speed.
+// BAUD_E must stay within 0-31 at both speeds.
+inline void
+clock_gov_init(struct clock_gov __xdata * gov, uint8_t fast, uint8_t slow, uint8_t uarts)
+{
+	gov->boost = 0;
+	gov->fast = fast;
+	gov->slow = slow;
+	gov->uarts = uarts;
+	gov->switches = 0;
+	clock_gov_set(gov, slow);
+}
+
+// Boosts nest. Not for use in ISRs, since switching waits for the USARTs.
+inline void
+clock_gov_boost(struct clock_gov __xdata * gov)
+{
+	if (!gov->boost++)
+		clock_gov_set(gov, gov->fast);
+}
+
+inline void
+clock_gov_release(struct clock_gov __xdata * gov)
+{
+	if (gov->boost && !--gov->boost)
+		clock_gov_set(gov, gov->slow);
+}
+
+// Run _body at the fast clock speed
+#define CLOCK_GOV_BOOSTED(_gov, _body)                                         \
+	do {                                                                       \
+		clock_gov_boost(_gov);                                                 \
+		_body;                                                                 \
+		clock_gov_release(_gov);                                               \
+	} while (0)
@@ -0,0 +1,40 @@
+// SPDX-FileCopyrightText: 2023 Andreas Sig Rosvall
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+#include <stdint.h>
+
+#define CRC16_CCITT_INIT 0xFFFFu
+
+// CRC-16/CCITT (polynomial 0x1021), one byte at a time without a table
+inline uint16_t
+crc16_ccitt_update(uint16_t crc, uint8_t b)
+{
+	uint8_t x = (crc >> 8) ^ b;
+	x ^= x >> 4;
+	return (crc << 8) ^ ((uint16_t)x << 12) ^ ((uint16_t)x << 5) ^ x;
+}
+
+inline uint16_t
+crc16_ccitt(uint16_t crc, const uint8_t * data, uint16_t len)
+{
+	while (len--)
+		crc = crc16_ccitt_update(crc, *data++);
+	return crc;
+}
+
+#define CRC32_INIT 0xFFFFFFFFul
+
+// CRC-32 (IEEE 802.3, reflected polynomial 0xEDB88320), bitwise without a table.
+// Finish by inverting the result.
+inline uint32_t
+crc32_update(uint32_t crc, uint8_t b)
+{
+	uint8_t i;
+
+	crc ^= b;
+	for (i = 0; i < 8; i++)
+		crc = (crc >> 1) ^ ((crc & 1) ? 0xEDB88320ul : 0);
+	return crc;
+}
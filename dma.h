@@ -145,7 +145,7 @@ enum {
 
 enum {
 	DMA_MODE1_WORD8  = 0,
-	DMA_MODE1_WORD16 = BIT(6),
+	DMA_MODE1_WORD16 = BIT(7),
 };
 
 enum {
@@ -0,0 +1,133 @@
+// SPDX-FileCopyrightText: 2023 Andreas Sig Rosvall
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+#include <compiler.h>
+#include <stdint.h>
+#include "bits.h"
+#include "dma.h"
+
+/*
+ * Circular capture on a repeated-mode DMA channel.
+ *
+ * The buffer is split in two halves. The channel is set up to transfer one
+ * half (in repeated single or repeated block mode, with DMA_MODE2_INTR_ENABLE)
+ * and is re-armed by hardware on completion. The configuration data is reloaded
+ * from xdata every time the channel is (re-)armed, so pointing the descriptor's
+ * destination at the other half right after arming gives a ping-pong buffer that
+ * runs without any CPU involvement per sample.
+ *
+ * The DMA controller has no readable transfer count, so the producer index is
+ * derived from the number of completed halves, which the DMA ISR counts by
+ * calling dma_ring_irq(). That is one interrupt per half buffer instead of one
+ * per sample.
+ *
+ * Typical use, e.g. continuous UART RX:
+ *
+ *   dma_set_src(conf, SFR_MAPPING_IN_XDATA + 0xC1); // U0DBUF
+ *   dma_set_mode1(conf, TRIG_URX0, BYTEMODE, REPEAT, WORD8);
+ *   dma_set_mode2(conf, PRIORITY_HIGH, NO_MASK8, INTR_ENABLE, SRC_CONST, DST_INC_1);
+ *   dma_ring_init(&ring, &conf, 0, buf, sizeof(buf) / 2);
+ *   dma_ring_start(&ring);
+ *
+ * and in the DMA ISR: dma_ring_irq(&ring);
+ */
+
+struct dma_ring {
+	struct dma_conf __xdata * conf;
+	uint8_t __xdata * buf;
+	uint16_t half_size;  // Size of one half in bytes
+	uint8_t ch;
+
+	// Number of halves filled by the DMA controller. Written from the DMA ISR only.
+	volatile uint8_t produced;
+	// Number of halves released by the consumer.
+	uint8_t consumed;
+};
+
+// Set up the ring and the descriptor's destination and length.
+// Source, trigger and address modes must already be set in conf.
+// half_size is in bytes and must be even in 16-bit word mode.
+inline void
+dma_ring_init(struct dma_ring __xdata * ring, struct dma_conf __xdata * conf,
+              uint8_t ch, uint8_t __xdata * buf, uint16_t half_size)
+{
+	uint16_t len = half_size;
+
+	if (conf->mode1 & DMA_MODE1_WORD16)
+		len >>= 1;
+
+	ring->conf      = conf;
+	ring->buf       = buf;
+	ring->half_size = half_size;
+	ring->ch        = ch;
+	ring->produced  = 0;
+	ring->consumed  = 0;
+
+	conf->dst = SWAP16((uint16_t)buf);
+	conf->len = SWAP16(len);
+}
+
+// Arm the channel on the first half and queue the second half for the first re-arm.
+inline void
+dma_ring_start(struct dma_ring __xdata * ring)
+{
+	DMAIRQ = ~BIT(ring->ch);
+	dma_arm(ring->ch);
+	ring->conf->dst = SWAP16((uint16_t)(ring->buf + ring->half_size));
+}
+
+inline void
+dma_ring_stop(struct dma_ring __xdata * ring)
+{
+	dma_abort(ring->ch);
+	DMAIRQ = ~BIT(ring->ch);
+}
+
+// Call from the DMA ISR. Returns nonzero if this ring's channel completed a half.
+// The channel has already been re-armed on the next half, so the descriptor is
+// pointed at the half that just completed, which becomes the one after next.
+inline uint8_t
+dma_ring_irq(struct dma_ring __xdata * ring)
+{
+	uint8_t done = DMAIRQ & BIT(ring->ch);
+
+	if (done) {
+		DMAIRQ = ~BIT(ring->ch);
+		ring->conf->dst = SWAP16((uint16_t)(ring->buf + ((ring->produced & 1) ? ring->half_size : 0)));
+		ring->produced++;
+	}
+	return done;
+}
+
+// Producer index: byte offset in the buffer the DMA is currently filling from.
+#define dma_ring_head(_ring) (((_ring)->produced & 1) ? (_ring)->half_size : 0)
+
+// Number of complete halves waiting for the consumer (0 or 1).
+// 2 or more means the DMA is already writing over the oldest unread half: the
+// consumer was overrun and data was lost.
+#define dma_ring_pending(_ring) ((uint8_t)((_ring)->produced - (_ring)->consumed))
+
+#define dma_ring_overrun(_ring) (dma_ring_pending(_ring) >= 2)
+
+// Half-buffer notification: first half is full and the DMA is on the second half.
+#define dma_ring_half_full(_ring) (dma_ring_pending(_ring) && !((_ring)->consumed & 1))
+
+// Full-buffer notification: second half is full and the DMA has wrapped.
+#define dma_ring_full(_ring) (dma_ring_pending(_ring) && ((_ring)->consumed & 1))
+
+// The oldest completed half, or NULL if none is pending.
+inline uint8_t __xdata *
+dma_ring_peek(struct dma_ring __xdata * ring)
+{
+	if (!dma_ring_pending(ring))
+		return 0;
+	return ring->buf + ((ring->consumed & 1) ? ring->half_size : 0);
+}
+
+// Give the oldest completed half back to the DMA.
+#define dma_ring_release(_ring)                                                \
+	do {                                                                       \
+		(_ring)->consumed++;                                                   \
+	} while (0)
@@ -0,0 +1,179 @@
+// SPDX-FileCopyrightText: 2023 Andreas Sig Rosvall
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+#include <compiler.h>
+#include <stdint.h>
+#include "bits.h"
+#include "dma.h"
+#include "timer1.h"
+
+/*
+ * DMA transfer profiling.
+ *
+ * Timestamps are taken from Timer 1, which must be running in free-running mode
+ * (T1CTL_MODE_FREE_RUNNING). Armed-to-done times are in Timer 1 ticks and must be
+ * shorter than one timer period (65536 ticks) to be meaningful.
+ *
+ * Arm channels through dma_stats_arm() instead of dma_arm(), and call
+ * dma_stats_done() when a channel completes, either from the DMA ISR or after
+ * dma_wait().
+ */
+
+struct dma_ch_stats {
+	uint32_t bytes;        // Bytes moved (maximum length for VLEN transfers)
+	uint16_t transfers;    // Completed transfers
+	uint16_t armed_at;     // Timer 1 count at arm time
+	uint16_t ticks_last;   // Armed-to-done time of last transfer
+	uint16_t ticks_max;    // Longest armed-to-done time seen
+	uint32_t ticks_total;  // Sum of armed-to-done times
+};
+
+// CPU throughput while a channel of a given priority is moving data.
+struct dma_cpu_stats {
+	uint32_t ticks;   // Timer 1 ticks spent probing
+	uint32_t iters;   // Probe loop iterations completed in that time
+	uint16_t probes;  // Number of probes
+	uint16_t starved; // Probes where the CPU got less than half of its idle throughput
+};
+
+struct dma_stats {
+	struct dma_ch_stats ch[DMA_CHANNEL_COUNT];
+	struct dma_cpu_stats cpu[DMA_MODE2_PRIORITY_HIGH + 1];
+
+	// Probe loop throughput with no DMA activity, from dma_stats_cpu_calibrate()
+	uint16_t idle_ticks;
+	uint16_t idle_iters;
+};
+
+// Bytes moved by one transfer with this configuration.
+inline uint16_t
+dma_conf_bytes(const struct dma_conf __xdata * conf)
+{
+	uint16_t len = SWAP16(conf->len) & DMA_MAX_LEN;
+
+	if (conf->mode1 & DMA_MODE1_WORD16)
+		len <<= 1;
+	return len;
+}
+
+inline void
+dma_stats_arm(struct dma_stats __xdata * stats, uint8_t ch, const struct dma_conf __xdata * conf)
+{
+	stats->ch[ch].bytes += dma_conf_bytes(conf);
+	stats->ch[ch].armed_at = timer1_read_count();
+	dma_arm(ch);
+}
+
+inline void
+dma_stats_done(struct dma_stats __xdata * stats, uint8_t ch)
+{
+	struct dma_ch_stats __xdata * s = &stats->ch[ch];
+	uint16_t ticks = timer1_read_count() - s->armed_at;
+
+	s->transfers++;
+	s->ticks_last = ticks;
+	s->ticks_total += ticks;
+	if (ticks > s->ticks_max)
+		s->ticks_max = ticks;
+}
+
+// Repeated-mode channels are re-armed by hardware, so restart the
+// armed-to-done measurement and byte count on every completion.
+inline void
+dma_stats_rearmed(struct dma_stats __xdata * stats, uint8_t ch, const struct dma_conf __xdata * conf)
+{
+	dma_stats_done(stats, ch);
+	stats->ch[ch].bytes += dma_conf_bytes(conf);
+	stats->ch[ch].armed_at = timer1_read_count();
+}
+
+// Average armed-to-done time in Timer 1 ticks.
+#define dma_stats_avg_ticks(_stats, _ch)                                       \
+	((_stats)->ch[_ch].transfers                                              \
+	     ? (uint16_t)((_stats)->ch[_ch].ticks_total / (_stats)->ch[_ch].transfers) \
+	     : 0)
+
+/*
+ * CPU starvation probe.
+ *
+ * The probe loop reads and writes xdata, competing with the DMA controller for
+ * the memory arbiter like ordinary firmware does. Its iteration rate while a
+ * channel is armed, relative to the idle rate, is the share of the bus the
+ * channel's DMA_MODE2_PRIORITY_* setting leaves to the CPU.
+ */
+inline uint16_t
+dma_stats_probe_loop(volatile uint8_t __xdata * scratch, uint8_t armed_mask, uint16_t max_ticks, uint16_t * ticks)
+{
+	uint16_t start = timer1_read_count();
+	uint16_t iters = 0;
+	uint16_t elapsed;
+
+	do {
+		(*scratch)++;
+		iters++;
+		elapsed = timer1_read_count() - start;
+	} while ((DMAARM & armed_mask) == armed_mask && elapsed < max_ticks);
+
+	*ticks = elapsed;
+	return iters;
+}
+
+// Measure idle probe throughput. Call with no DMA channels armed.
+inline void
+dma_stats_cpu_calibrate(struct dma_stats __xdata * stats, volatile uint8_t __xdata * scratch, uint16_t ticks)
+{
+	stats->idle_iters = dma_stats_probe_loop(scratch, 0, ticks, &stats->idle_ticks);
+}
+
+// Run the probe for as long as channel ch stays armed (at most max_ticks).
+// Call right after arming the channel with a configuration of priority prio.
+inline void
+dma_stats_cpu_probe(struct dma_stats __xdata * stats, volatile uint8_t __xdata * scratch,
+                    uint8_t ch, uint8_t prio, uint16_t max_ticks)
+{
+	struct dma_cpu_stats __xdata * c;
+	uint16_t ticks;
+	uint16_t iters;
+
+	// Priority 3 is reserved
+	if (prio > DMA_MODE2_PRIORITY_HIGH)
+		return;
+	c = &stats->cpu[prio];
+	iters = dma_stats_probe_loop(scratch, BIT(ch), max_ticks, &ticks);
+	if (!ticks)
+		return;
+
+	c->ticks += ticks;
+	c->iters += iters;
+	c->probes++;
+
+	// iters / ticks < (idle_iters / idle_ticks) / 2
+	if ((uint32_t)iters * stats->idle_ticks < ((uint32_t)stats->idle_iters * ticks) >> 1)
+		c->starved++;
+}
+
+// CPU throughput under DMA of priority prio, in percent of idle throughput.
+inline uint8_t
+dma_stats_cpu_share_pct(const struct dma_stats __xdata * stats, uint8_t prio)
+{
+	const struct dma_cpu_stats __xdata * c;
+	uint32_t idle;
+
+	if (prio > DMA_MODE2_PRIORITY_HIGH)
+		return 100;
+	c = &stats->cpu[prio];
+	if (!c->ticks || !stats->idle_ticks)
+		return 100;
+
+	// Iterations the probe would have completed in c->ticks with no DMA,
+	// split to stay within 32 bits.
+	idle = c->ticks / stats->idle_ticks * stats->idle_iters
+	     + c->ticks % stats->idle_ticks * stats->idle_iters / stats->idle_ticks;
+	if (!idle || c->iters >= idle)
+		return 100;
+	if (idle >= 100)
+		return (uint8_t)(c->iters / (idle / 100));
+	return (uint8_t)(c->iters * 100 / idle);
+}
@@ -6,9 +6,12 @@
 #include <compiler.h>
 #include <stdint.h>
 #include "bits.h"
+#include "interrupts.h"
+#include "mem.h"
 
 // Flash Bank Map
 SFR(FMAP, 0x9F);
+#define FMAP_MAP__MASK BITMASK(3, 0)  // Bank mapped at code 0x8000-0xFFFF
 
 /* Page erase.
 	Erase the page that is given by FADDRH[7 (CC2530, CC2531, CC2540, and CC2541) or FADDRH[6 (CC2533).
@@ -45,6 +48,7 @@ enum flash_fctl_cache_mode {
 	FLASH_CTL_CACHE_MODE_PREFETCH = (2u<<2),
 	FLASH_CTL_CACHE_MODE_REALTIME = (3u<<2),
 };
+#define FLASH_CTL_CACHE_MODE__MASK BITMASK(2, 2)
 
 /* Abort status. This bit is set when a write operation or page erase is aborted.
 	An operation is aborted when the page accessed is locked.
@@ -91,3 +95,80 @@ __xdata __at(0x6270) struct {
 
 #define FLASH_PAGE_SIZE 2048u
 #define FLASH_WORD_SIZE 4u
+
+#define FLASH_PAGE_WORDS (FLASH_PAGE_SIZE / FLASH_WORD_SIZE)
+#define FLASH_PAGES_PER_BANK (XBANK_SIZE / FLASH_PAGE_SIZE)
+
+// Flash word address (as written to FLASH.addr) of a byte offset in a page
+#define FLASH_WORD_ADDR(_page, _offset)                                        \
+	((((uint16_t)(_page)) << 9) + ((uint16_t)(_offset) / FLASH_WORD_SIZE))
+
+#define flash_wait_busy()                                                      \
+	do {                                                                       \
+	} while (FLASH.ctl & FLASH_CTL_BUSY)
+
+// Erase a 2 KB page. Returns nonzero if the erase was aborted (page locked).
+inline uint8_t
+flash_erase_page(uint8_t page)
+{
+	flash_wait_busy();
+	FLASH.addr = FLASH_WORD_ADDR(page, 0);
+	FLASH.ctl |= FLASH_CTL_ERASE;
+	flash_wait_busy();
+	return FLASH.ctl & FLASH_CTL_ABORT;
+}
+
+// Program len bytes (a multiple of FLASH_WORD_SIZE) from src, starting at a flash word address.
+// Programming can only clear bits, so the words must be erased or only have bits cleared.
+// The CPU cannot fetch code from flash while a word is being programmed, so the
+// loop runs from SRAM (see ramfunc.h): exactly one translation unit, starting
+// with #pragma codeseg RAMFUNC, defines FLASH_WRITE_RAMFUNC before including
+// this file.
+// Returns nonzero if the write was aborted (page locked).
+uint8_t
+flash_write_ram(uint16_t word_addr, const uint8_t * src, uint16_t len);
+
+#ifdef FLASH_WRITE_RAMFUNC
+uint8_t
+flash_write_ram(uint16_t word_addr, const uint8_t * src, uint16_t len)
+{
+	flash_wait_busy();
+	FLASH.addr = word_addr;
+	FLASH.ctl |= FLASH_CTL_WRITE;
+	while (len--) {
+		FLASH.wdata = *src++;
+		while (FLASH.ctl & FLASH_CTL_FULL)
+			;
+	}
+	flash_wait_busy();
+	return FLASH.ctl & FLASH_CTL_ABORT;
+}
+#endif
+
+// flash_write_ram() with SRAM mapped into code space for the duration of the
+// write. As with RAMFUNC_CALL(), call from the root bank. Interrupts are
+// disabled meanwhile, since their handlers would be fetched from flash.
+// src must not point into code space above 0x8000.
+inline uint8_t
+flash_write(uint16_t word_addr, const uint8_t * src, uint16_t len)
+{
+	uint8_t ea = IEN0_EA;
+	uint8_t memctr = MEMCTR;
+	uint8_t err;
+
+	IEN0_EA = 0;
+	MEMCTR = memctr | MEMCTR_XMAP;
+	err = flash_write_ram(word_addr, src, len);
+	MEMCTR = memctr;
+	IEN0_EA = ea;
+	return err;
+}
+
+// Map the bank holding a flash page into xdata and return the page's xdata address.
+// This changes MEMCTR.XBANK; save and restore MEMCTR around it if other code relies on the mapping.
+inline const uint8_t __xdata *
+flash_page_map(uint8_t page)
+{
+	MEMCTR = (MEMCTR & ~MEMCTR_XBANK__MASK) | (page / FLASH_PAGES_PER_BANK);
+	return (const uint8_t __xdata *)(FLASH_MAPPING_IN_XDATA + (page % FLASH_PAGES_PER_BANK) * FLASH_PAGE_SIZE);
+}
@@ -0,0 +1,130 @@
+// SPDX-FileCopyrightText: 2023 Andreas Sig Rosvall
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+#include <compiler.h>
+#include <stdint.h>
+#include "bits.h"
+#include "crc.h"
+#include "flash.h"
+#include "mac_timer.h"
+
+/*
+ * Flash cache mode selection and benchmarking.
+ *
+ * The best cache mode depends on the code that runs: prefetch helps straight-line
+ * code, but costs power and can make loops slower than plain caching, and
+ * real-time mode trades throughput for constant fetch timing. Rather than
+ * guessing, time the actual workloads under each mode:
+ *
+ *   struct flash_cache_bench b;
+ *
+ *   flash_cache_bench_run(&b, 16, radio_isr_body());
+ *   flash_cache_set_mode(flash_cache_bench_best(&b, 5));
+ *
+ * and switch modes per phase of the application:
+ *
+ *   FLASH_CACHE_PHASE(REALTIME, {
+ *       slot_tx();
+ *   });
+ *
+ * Timing uses the MAC timer (32 MHz, so one tick is one CPU cycle at full
+ * speed), which must be running with T2CTRL_LATCH_MODE set.
+ */
+
+#define FLASH_CACHE_MODES 4
+
+#define flash_cache_get_mode() (FLASH.ctl & FLASH_CTL_CACHE_MODE__MASK)
+
+// Writes to CACHEMODE are ignored while a mode change is in progress, so write
+// until the new mode reads back. ERASE and WRITE are unaffected by writing 0.
+inline void
+flash_cache_set_mode(uint8_t mode)
+{
+	while (flash_cache_get_mode() != mode)
+		FLASH.ctl = mode;
+}
+
+// Run _body with cache mode FLASH_CTL_CACHE_MODE_##_mode, then restore the previous mode
+#define FLASH_CACHE_PHASE(_mode, _body)                                        \
+	do {                                                                       \
+		uint8_t _saved_mode = flash_cache_get_mode();                          \
+		flash_cache_set_mode(FLASH_CTL_CACHE_MODE_##_mode);                    \
+		_body;                                                                 \
+		flash_cache_set_mode(_saved_mode);                                     \
+	} while (0)
+
+struct flash_cache_bench {
+	uint32_t ticks[FLASH_CACHE_MODES];  // MAC timer ticks, indexed by mode >> 2
+};
+
+// Time _reps runs of the statement _body under each cache mode, after one untimed
+// warm-up run per mode. The current mode is restored afterwards.
+// Run with interrupts disabled to keep handlers out of the results.
+#define flash_cache_bench_run(_bench, _reps, _body)                            \
+	do {                                                                       \
+		uint8_t _saved_mode = flash_cache_get_mode();                          \
+		uint16_t _period = mac_timer_get_period();                             \
+		uint8_t _m, _r;                                                        \
+		for (_m = 0; _m < FLASH_CACHE_MODES; _m++) {                           \
+			uint32_t _t0;                                                      \
+			flash_cache_set_mode(_m << 2);                                     \
+			_body;                                                             \
+			_t0 = mac_timer_read_raw();                                        \
+			for (_r = 0; _r < (_reps); _r++) {                                 \
+				_body;                                                         \
+			}                                                                  \
+			(_bench)->ticks[_m] = mac_timer_raw_elapsed(_t0, mac_timer_read_raw(), _period); \
+		}                                                                      \
+		flash_cache_set_mode(_saved_mode);                                     \
+	} while (0)
+
+// Add the results of another benchmark, e.g. to weigh several workloads together.
+inline void
+flash_cache_bench_add(struct flash_cache_bench * sum, const struct flash_cache_bench * b)
+{
+	uint8_t m;
+
+	for (m = 0; m < FLASH_CACHE_MODES; m++)
+		sum->ticks[m] += b->ticks[m];
+}
+
+// The fastest mode. Enabled (lowest power of the caching modes) is preferred
+// unless another mode is more than slack_pct percent faster.
+inline uint8_t
+flash_cache_bench_best(const struct flash_cache_bench * b, uint8_t slack_pct)
+{
+	uint8_t best = FLASH_CTL_CACHE_MODE_ENABLED >> 2;
+	uint32_t limit = b->ticks[best] - b->ticks[best] / 100 * slack_pct;
+	uint8_t m;
+
+	for (m = 0; m < FLASH_CACHE_MODES; m++) {
+		if (b->ticks[m] < limit) {
+			best = m;
+			limit = b->ticks[m];
+		}
+	}
+	return best << 2;
+}
+
+// Built-in workloads, for comparing against the application's own.
+
+// Copy n bytes xdata to xdata
+#define FLASH_CACHE_WORKLOAD_MEMCPY(_dst, _src, _n)                            \
+	do {                                                                       \
+		uint8_t __xdata * _d = (_dst);                                         \
+		const uint8_t __xdata * _s = (_src);                                   \
+		uint16_t _i = (_n);                                                    \
+		while (_i--)                                                           \
+			*_d++ = *_s++;                                                     \
+	} while (0)
+
+// Bitwise CRC-16/CCITT over n bytes: a tight loop with branches
+#define FLASH_CACHE_WORKLOAD_CRC(_crc, _src, _n)                               \
+	do {                                                                       \
+		const uint8_t __xdata * _s = (_src);                                   \
+		uint16_t _i = (_n);                                                    \
+		while (_i--)                                                           \
+			(_crc) = crc16_ccitt_update((_crc), *_s++);                        \
+	} while (0)
@@ -0,0 +1,84 @@
+// SPDX-FileCopyrightText: 2023 Andreas Sig Rosvall
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+#include <compiler.h>
+#include <stdint.h>
+#include "bits.h"
+#include "dma.h"
+#include "flash.h"
+#include "mem.h"
+
+/*
+ * DMA-driven flash programming.
+ *
+ * A DMA channel triggered by DMA_TRIG_FLASH feeds FWDATA as fast as the flash
+ * controller accepts data, instead of the CPU polling FLASH_CTL_FULL for every
+ * 4 bytes. The write is started and waited for by a small stub executing from
+ * SRAM (via MEMCTR_XMAP), since the CPU cannot fetch code from flash while the
+ * flash is being programmed.
+ *
+ * Because MEMCTR_XMAP replaces the upper code bank (0x8000-0xFFFF) with SRAM,
+ * flash_dma_write() must be called from the root bank, and interrupt handlers
+ * that may run during the write must also live in the root bank.
+ */
+
+// 8051 machine code of the SRAM stub:
+//    mov   dptr,#0x6270    ; FCTL
+//    movx  a,@dptr
+//    orl   a,#0x02         ; FLASH_CTL_WRITE
+//    movx  @dptr,a
+// 1: movx  a,@dptr
+//    jb    acc.7,1b        ; FLASH_CTL_BUSY
+//    ret
+#define FLASH_DMA_STUB                                                         \
+	{ 0x90, 0x62, 0x70, 0xE0, 0x44, 0x02, 0xF0, 0xE0, 0x20, 0xE7, 0xFC, 0x22 }
+#define FLASH_DMA_STUB_SIZE 12
+
+// xdata address of FWDATA
+#define FLASH_WDATA_XADDR 0x6273u
+
+// Copy the stub into SRAM. ram must be below the SRAM size (not in the 0x8000+ flash window).
+inline void
+flash_dma_stub_load(uint8_t __xdata * ram)
+{
+	const uint8_t __code stub[FLASH_DMA_STUB_SIZE] = FLASH_DMA_STUB;
+	uint8_t i;
+
+	for (i = 0; i < FLASH_DMA_STUB_SIZE; i++)
+		ram[i] = stub[i];
+}
+
+// Set up a DMA descriptor to stream len bytes from src into FWDATA.
+inline void
+flash_dma_setup(struct dma_conf __xdata * conf, const uint8_t __xdata * src, uint16_t len)
+{
+	conf->src = SWAP16((uint16_t)src);
+	conf->dst = SWAP16(FLASH_WDATA_XADDR);
+	conf->len = DMA_LEN(len, FIXED);
+	conf->mode1 = DMA_MODE1(TRIG_FLASH, BYTEMODE, ONESHOT, WORD8);
+	conf->mode2 = DMA_MODE2(PRIORITY_HIGH, NO_MASK8, INTR_DISABLE, SRC_INC_1, DST_CONST);
+}
+
+// Program len bytes (a multiple of FLASH_WORD_SIZE) from xdata at a flash word address.
+// conf must be the configuration of channel ch (see dma_init_ch0() and dma_init_ch1_4()),
+// and stub an SRAM copy made by flash_dma_stub_load().
+// Returns nonzero if the write was aborted (page locked).
+inline uint8_t
+flash_dma_write(struct dma_conf __xdata * conf, uint8_t ch, const uint8_t __xdata * stub,
+                uint16_t word_addr, const uint8_t __xdata * src, uint16_t len)
+{
+	uint8_t memctr = MEMCTR;
+
+	flash_wait_busy();
+	flash_dma_setup(conf, src, len);
+	FLASH.addr = word_addr;
+	dma_arm(ch);
+
+	MEMCTR = memctr | MEMCTR_XMAP;
+	((void (*)(void))XMAP_CODE_ADDR(stub))();
+	MEMCTR = memctr;
+
+	return FLASH.ctl & FLASH_CTL_ABORT;
+}
@@ -0,0 +1,158 @@
+// SPDX-FileCopyrightText: 2023 Andreas Sig Rosvall
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+#include <compiler.h>
+#include <stdint.h>
+#include "bits.h"
+#include "mem.h"
+
+/*
+ * Streaming reads of an arbitrary flash range.
+ *
+ * Flash is read through the 32 KB xdata window at 0x8000, which shows the bank
+ * selected by MEMCTR.XBANK. The reader remaps MEMCTR only when the stream
+ * crosses a bank boundary, and flash_reader_close() restores the mapping that
+ * was in place when the reader was opened.
+ *
+ * Between open and close, nothing else (including interrupt handlers) may
+ * change MEMCTR.XBANK.
+ *
+ * For bulk processing, flash_reader_window() hands out the largest span that can
+ * be read directly through the window, so inner loops run on a plain pointer:
+ *
+ *   while ((p = flash_reader_window(&r, &n))) {
+ *       flash_reader_consume(&r, n);
+ *       while (n--)
+ *           crc = crc16_ccitt_update(crc, *p++);
+ *   }
+ *
+ * flash_reader_prefetch() does the remap ahead of time and tells how much of a
+ * read is left before the next one, e.g. to size a DMA transfer.
+ */
+
+struct flash_reader {
+	uint32_t addr;                // Flash address after the current window
+	uint32_t left;                // Bytes after the current window
+	const uint8_t __xdata * p;    // Next byte in the current window
+	uint16_t window;              // Bytes left in the current window
+	uint8_t memctr;               // MEMCTR when opened
+};
+
+// Map the next window: up to the end of the bank or the end of the range.
+inline void
+flash_reader_remap(struct flash_reader __xdata * r)
+{
+	uint16_t off = (uint16_t)r->addr & (XBANK_SIZE - 1);
+	uint16_t n = XBANK_SIZE - off;
+
+	if (n > r->left)
+		n = r->left;
+
+	MEMCTR = (r->memctr & ~MEMCTR_XBANK__MASK) | (uint8_t)(r->addr / XBANK_SIZE);
+	r->p = (const uint8_t __xdata *)(FLASH_MAPPING_IN_XDATA | off);
+	r->window = n;
+	r->addr += n;
+	r->left -= n;
+}
+
+// Start reading len bytes at 24-bit flash address addr.
+inline void
+flash_reader_open(struct flash_reader __xdata * r, uint32_t addr, uint32_t len)
+{
+	r->memctr = MEMCTR;
+	r->addr = addr;
+	r->left = len;
+	r->window = 0;
+}
+
+#define flash_reader_close(_r)                                                 \
+	do {                                                                       \
+		MEMCTR = (_r)->memctr;                                                 \
+	} while (0)
+
+// Flash address of the next byte
+#define flash_reader_tell(_r) ((_r)->addr - (_r)->window)
+
+#define flash_reader_eof(_r) (!(_r)->window && !(_r)->left)
+
+// Next byte, or -1 at the end of the range
+inline int16_t
+flash_reader_getc(struct flash_reader __xdata * r)
+{
+	if (!r->window) {
+		if (!r->left)
+			return -1;
+		flash_reader_remap(r);
+	}
+	r->window--;
+	return *r->p++;
+}
+
+// The current contiguous span and its length in *n, or NULL at the end of the range.
+// Does not consume anything.
+inline const uint8_t __xdata *
+flash_reader_window(struct flash_reader __xdata * r, uint16_t * n)
+{
+	if (!r->window) {
+		if (!r->left)
+			return 0;
+		flash_reader_remap(r);
+	}
+	*n = r->window;
+	return r->p;
+}
+
+// Prepare for reading n bytes: maps the next bank now if the current window is
+// used up, so the remap happens before a time-critical loop rather than in it.
+// Returns how many of the n bytes can then be read without another remap.
+inline uint16_t
+flash_reader_prefetch(struct flash_reader __xdata * r, uint16_t n)
+{
+	if (!r->window && r->left)
+		flash_reader_remap(r);
+	return n < r->window ? n : r->window;
+}
+
+// Consume n bytes of the current span (n <= the length given by flash_reader_window()).
+#define flash_reader_consume(_r, _n)                                           \
+	do {                                                                       \
+		(_r)->window -= (_n);                                                  \
+		(_r)->p += (_n);                                                       \
+	} while (0)
+
+// Copy up to len bytes to dst. Returns the number of bytes copied.
+inline uint16_t
+flash_reader_read(struct flash_reader __xdata * r, uint8_t * dst, uint16_t len)
+{
+	uint16_t done = 0;
+	uint16_t n;
+	const uint8_t __xdata * p;
+
+	while (done < len && (p = flash_reader_window(r, &n))) {
+		if (n > len - done)
+			n = len - done;
+		flash_reader_consume(r, n);
+		done += n;
+		while (n--)
+			*dst++ = *p++;
+	}
+	return done;
+}
+
+// Skip len bytes (or to the end of the range)
+inline void
+flash_reader_skip(struct flash_reader __xdata * r, uint32_t len)
+{
+	if (len <= r->window) {
+		flash_reader_consume(r, (uint16_t)len);
+		return;
+	}
+	len -= r->window;
+	if (len > r->left)
+		len = r->left;
+	r->addr += len;
+	r->left -= len;
+	r->window = 0;
+}
@@ -0,0 +1,159 @@
+// SPDX-FileCopyrightText: 2023 Andreas Sig Rosvall
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+#include <compiler.h>
+#include <stdint.h>
+#include "bits.h"
+#include "flash.h"
+#include "mem.h"
+
+/*
+ * Persistent monotonic frame counter (e.g. for 802.15.4 security).
+ *
+ * Flash is written only when the counter crosses into a new block of
+ * FRAME_COUNTER_BLOCK values: the block is reserved first, then handed out from
+ * RAM. After a reset, counting resumes at the start of the block following the
+ * last reservation, so values are never reused, at the cost of skipping at most
+ * one block per reset.
+ *
+ * Reservations are recorded by writing the log words of a page to 0, one word
+ * per block, so each flash word is written only once between erases. Any word
+ * that is not erased counts as a reservation, so a write interrupted by a reset
+ * can only skip a block, never reuse one.
+ *
+ * Two pages are used alternately. Each starts with a base value word; when the
+ * log of the current page is used up, the other page is erased and started with
+ * the current reservation as its base.
+ *
+ * Page layout: [base (uint32)] [log word] [log word] ...
+ */
+
+#ifndef FRAME_COUNTER_BLOCK
+#define FRAME_COUNTER_BLOCK 1024ul
+#endif
+
+// Reservations per page
+#define FRAME_COUNTER_LOG_WORDS (FLASH_PAGE_WORDS - 1)
+
+struct frame_counter {
+	uint8_t page[2];  // The two flash pages used
+	uint8_t cur;      // Index of the page in use
+	uint32_t base;    // Base value of the page in use
+	uint16_t used;    // Number of written log words (reservations) in the page in use
+	uint32_t next;    // Next value to hand out
+	uint32_t limit;   // End of the current reservation
+};
+
+// Count written words in the log of a mapped page
+inline uint16_t
+frame_counter_scan(const uint8_t __xdata * page)
+{
+	const uint32_t __xdata * log = (const uint32_t __xdata *)page + 1;
+	uint16_t used;
+
+	for (used = 0; used < FRAME_COUNTER_LOG_WORDS; used++)
+		if (log[used] == 0xFFFFFFFFul)
+			break;
+	return used;
+}
+
+// Record one more reservation in the page in use
+inline uint8_t
+frame_counter_mark(struct frame_counter __xdata * fc)
+{
+	uint32_t w = 0;
+
+	if (flash_write(FLASH_WORD_ADDR(fc->page[fc->cur], 0) + 1 + fc->used, (const uint8_t *)&w, sizeof(w)))
+		return 1;
+	fc->used++;
+	return 0;
+}
+
+// Start a fresh page with base as its first value
+inline uint8_t
+frame_counter_switch(struct frame_counter __xdata * fc, uint32_t base)
+{
+	uint8_t other = fc->cur ^ 1;
+
+	if (flash_erase_page(fc->page[other]))
+		return 1;
+	if (flash_write(FLASH_WORD_ADDR(fc->page[other], 0), (const uint8_t *)&base, sizeof(base)))
+		return 1;
+
+	fc->cur = other;
+	fc->base = base;
+	fc->used = 0;
+	return 0;
+}
+
+// Reserve the next block, starting at fc->limit
+inline uint8_t
+frame_counter_reserve(struct frame_counter __xdata * fc)
+{
+	if (fc->used >= FRAME_COUNTER_LOG_WORDS) {
+		if (frame_counter_switch(fc, fc->limit))
+			return 1;
+	}
+	if (frame_counter_mark(fc))
+		return 1;
+
+	fc->next = fc->limit;
+	fc->limit = fc->base + (uint32_t)fc->used * FRAME_COUNTER_BLOCK;
+	return 0;
+}
+
+// Load the counter from flash, or start it at 0 if neither page holds a base value.
+// Reserves the first block, so the first value handed out has never been used before.
+inline uint8_t
+frame_counter_init(struct frame_counter __xdata * fc, uint8_t page0, uint8_t page1)
+{
+	uint8_t memctr = MEMCTR;
+	uint32_t base[2];
+	uint8_t i;
+	uint8_t err;
+
+	fc->page[0] = page0;
+	fc->page[1] = page1;
+
+	for (i = 0; i < 2; i++)
+		base[i] = *(const uint32_t __xdata *)flash_page_map(fc->page[i]);
+
+	// An erased base reads as 0xFFFFFFFF. Use the page with the highest valid base.
+	if (base[0] == 0xFFFFFFFFul && base[1] == 0xFFFFFFFFul) {
+		fc->cur = 1;
+		err = frame_counter_switch(fc, 0);
+	} else {
+		fc->cur = (base[1] != 0xFFFFFFFFul && (base[0] == 0xFFFFFFFFul || base[1] > base[0]));
+		fc->base = base[fc->cur];
+		fc->used = frame_counter_scan(flash_page_map(fc->page[fc->cur]));
+		err = 0;
+	}
+	MEMCTR = memctr;
+
+	if (err)
+		return err;
+
+	// Everything up to the last reservation may have been handed out already
+	fc->limit = fc->base + (uint32_t)fc->used * FRAME_COUNTER_BLOCK;
+	return frame_counter_reserve(fc);
+}
+
+// Current value, without consuming it
+#define frame_counter_peek(_fc) ((_fc)->next)
+
+// Hand out the next value. Writes flash only when a new block must be reserved.
+// Sets *err nonzero if the reservation could not be written, in which case no
+// value is handed out.
+inline uint32_t
+frame_counter_next(struct frame_counter __xdata * fc, uint8_t * err)
+{
+	*err = 0;
+	if (fc->next == fc->limit) {
+		*err = frame_counter_reserve(fc);
+		if (*err)
+			return fc->next;
+	}
+	return fc->next++;
+}
@@ -0,0 +1,116 @@
+// SPDX-FileCopyrightText: 2023 Andreas Sig Rosvall
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+#include <compiler.h>
+#include <stdint.h>
+#include "bits.h"
+#include "interrupts.h"
+#include "radio.h"
+
+/*
+ * Pool of radio frame buffers.
+ *
+ * Frames are referred to by their index in the pool, which fits in a byte and
+ * can be passed through queues cheaply. Free frames are linked through an index
+ * array, so alloc and free are O(1). Each frame has a reference count: a received
+ * frame can be handed to several consumers (USB, the MAC, forwarding), each of
+ * which takes a reference and drops it when done, and the frame returns to the
+ * pool when the last reference is dropped.
+ *
+ * All operations may be used from interrupt handlers. They disable interrupts
+ * only for the few instructions that update the free list or a count.
+ */
+
+#ifndef FRAME_POOL_SIZE
+#define FRAME_POOL_SIZE 8
+#endif
+
+#define FRAME_POOL_FRAME_SIZE sizeof(RADIO.rxfifo_mem)
+#define FRAME_POOL_NONE 0xFF
+
+#if FRAME_POOL_SIZE >= FRAME_POOL_NONE
+#error "FRAME_POOL_SIZE too large"
+#endif
+
+struct frame_pool {
+	uint8_t frame[FRAME_POOL_SIZE][FRAME_POOL_FRAME_SIZE];
+	uint8_t next[FRAME_POOL_SIZE];   // Free list links
+	uint8_t refs[FRAME_POOL_SIZE];
+	uint8_t head;                    // First free frame, or FRAME_POOL_NONE
+	uint8_t nfree;
+	uint8_t min_free;                // Low-water mark of nfree
+	uint8_t failed;                  // Failed allocations (saturating)
+};
+
+#define frame_pool_buf(_pool, _idx) ((_pool)->frame[_idx])
+#define frame_pool_index(_pool, _buf)                                          \
+	((uint8_t)(((uint8_t __xdata *)(_buf) - (_pool)->frame[0]) / FRAME_POOL_FRAME_SIZE))
+
+inline void
+frame_pool_init(struct frame_pool __xdata * pool)
+{
+	uint8_t i;
+
+	for (i = 0; i < FRAME_POOL_SIZE; i++) {
+		pool->next[i] = i + 1;
+		pool->refs[i] = 0;
+	}
+	pool->next[FRAME_POOL_SIZE - 1] = FRAME_POOL_NONE;
+	pool->head = 0;
+	pool->nfree = FRAME_POOL_SIZE;
+	pool->min_free = FRAME_POOL_SIZE;
+	pool->failed = 0;
+}
+
+// A frame with one reference, or FRAME_POOL_NONE if the pool is empty
+inline uint8_t
+frame_pool_alloc(struct frame_pool __xdata * pool)
+{
+	uint8_t ea = IEN0_EA;
+	uint8_t idx;
+
+	IEN0_EA = 0;
+	idx = pool->head;
+	if (idx != FRAME_POOL_NONE) {
+		pool->head = pool->next[idx];
+		pool->refs[idx] = 1;
+		if (--pool->nfree < pool->min_free)
+			pool->min_free = pool->nfree;
+	} else if (pool->failed != 0xFF) {
+		pool->failed++;
+	}
+	IEN0_EA = ea;
+	return idx;
+}
+
+// Take another reference to a frame
+inline void
+frame_pool_ref(struct frame_pool __xdata * pool, uint8_t idx)
+{
+	uint8_t ea = IEN0_EA;
+
+	IEN0_EA = 0;
+	pool->refs[idx]++;
+	IEN0_EA = ea;
+}
+
+// Drop a reference. The frame is freed when the last one is dropped.
+// Dropping a reference to a free frame does nothing.
+inline void
+frame_pool_unref(struct frame_pool __xdata * pool, uint8_t idx)
+{
+	uint8_t ea = IEN0_EA;
+
+	IEN0_EA = 0;
+	if (pool->refs[idx] && !--pool->refs[idx]) {
+		pool->next[idx] = pool->head;
+		pool->head = idx;
+		pool->nfree++;
+	}
+	IEN0_EA = ea;
+}
+
+#define frame_pool_refs(_pool, _idx) ((_pool)->refs[_idx])
+#define frame_pool_free_count(_pool) ((_pool)->nfree)
@@ -0,0 +1,379 @@
+// SPDX-FileCopyrightText: 2023 Andreas Sig Rosvall
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+#include <compiler.h>
+#include <stdint.h>
+#include "bits.h"
+#include "crc.h"
+#include "flash.h"
+#include "mem.h"
+
+/*
+ * Log-structured key/value store in flash.
+ *
+ * The store uses npages consecutive flash pages, of which one is active at a time.
+ * New values are appended to the active page; the latest valid record for a key
+ * wins. When the active page is full, the live records are copied to the next
+ * page in the ring, which then becomes active. Erases are thus spread evenly over
+ * all pages, and a page is only erased right before it is reused, so a power
+ * failure during garbage collection leaves the previous page intact.
+ *
+ * Page layout:    [page header word] [record] [record] ... [erased 0xFF...]
+ * Record layout:  [key] [len] [crc16 (LE)] [data, padded to a whole flash word]
+ *
+ * Keys 0x00-0xFE are valid; an erased header (key 0xFF) marks the end of the log.
+ * A record with len 0 deletes the key. The CRC covers key, len and data, so torn
+ * writes are skipped on lookup.
+ *
+ * Garbage collection needs a struct kv_scratch work area, given to kv_init().
+ * It is only used within kv_put(), so it can be an overlay region (see
+ * overlay.h) shared with users that never run at the same time.
+ */
+
+#define KV_PAGE_MAGIC 0x4B56u // "KV"
+#define KV_KEY_ERASED 0xFFu
+#define KV_HDR_SIZE   FLASH_WORD_SIZE
+
+#ifndef KV_HOT_KEYS
+#define KV_HOT_KEYS 8
+#endif
+
+#define KV_NOT_FOUND 0
+
+struct kv_page_hdr {
+	uint16_t magic;
+	uint16_t seq;  // Generation, incremented on every garbage collection
+};
+
+struct kv_rec_hdr {
+	uint8_t key;
+	uint8_t len;
+	uint16_t crc;
+};
+
+// Garbage collection work area
+struct kv_scratch {
+	uint16_t latest[KV_KEY_ERASED];  // Offset of the latest valid record per key
+	uint8_t buf[255];                // Record being copied
+};
+
+// In-RAM index entry: offset of the latest record for a key in the active page
+struct kv_hot {
+	uint8_t key;
+	uint16_t offset;
+};
+
+struct kv_store {
+	uint8_t first_page;
+	uint8_t npages;
+	uint8_t active;      // Index of the active page, 0..npages-1
+	uint16_t seq;
+	uint16_t write_off;  // Offset of the first erased word in the active page
+
+	struct kv_hot hot[KV_HOT_KEYS];
+	uint8_t hot_next;    // Round-robin replacement index
+
+	struct kv_scratch __xdata * scratch;
+};
+
+#define KV_REC_SIZE(_len) \
+	(KV_HDR_SIZE + (((uint16_t)(_len) + FLASH_WORD_SIZE - 1) & ~(FLASH_WORD_SIZE - 1)))
+
+#define kv_active_page(_kv) ((uint8_t)((_kv)->first_page + (_kv)->active))
+
+inline uint16_t
+kv_rec_crc(const struct kv_rec_hdr * hdr, const uint8_t * data)
+{
+	uint16_t crc = crc16_ccitt_update(CRC16_CCITT_INIT, hdr->key);
+	crc = crc16_ccitt_update(crc, hdr->len);
+	return crc16_ccitt(crc, data, hdr->len);
+}
+
+// Offset past the last record in a mapped page
+inline uint16_t
+kv_scan_end(const uint8_t __xdata * page)
+{
+	uint16_t off = KV_HDR_SIZE;
+
+	while (off <= FLASH_PAGE_SIZE - KV_HDR_SIZE) {
+		const struct kv_rec_hdr __xdata * rec = (const struct kv_rec_hdr __xdata *)(page + off);
+		if (rec->key == KV_KEY_ERASED)
+			break;
+		off += KV_REC_SIZE(rec->len);
+	}
+	return off > FLASH_PAGE_SIZE ? FLASH_PAGE_SIZE : off;
+}
+
+// Offset of the latest valid record for key in a mapped page, or KV_NOT_FOUND
+inline uint16_t
+kv_scan_key(const uint8_t __xdata * page, uint8_t key, uint16_t end)
+{
+	uint16_t off = KV_HDR_SIZE;
+	uint16_t found = KV_NOT_FOUND;
+
+	while (off + KV_HDR_SIZE <= end) {
+		const struct kv_rec_hdr __xdata * rec = (const struct kv_rec_hdr __xdata *)(page + off);
+		uint16_t next = off + KV_REC_SIZE(rec->len);
+
+		if (next > end)
+			break;
+		if (rec->key == key && rec->crc == kv_rec_crc(rec, (const uint8_t *)(rec + 1)))
+			found = off;
+		off = next;
+	}
+	return found;
+}
+
+inline void
+kv_hot_set(struct kv_store __xdata * kv, uint8_t key, uint16_t offset)
+{
+	uint8_t i;
+
+	for (i = 0; i < KV_HOT_KEYS; i++) {
+		if (kv->hot[i].key == key) {
+			kv->hot[i].offset = offset;
+			return;
+		}
+	}
+	kv->hot[kv->hot_next].key = key;
+	kv->hot[kv->hot_next].offset = offset;
+	kv->hot_next = (kv->hot_next + 1) % KV_HOT_KEYS;
+}
+
+inline void
+kv_hot_clear(struct kv_store __xdata * kv)
+{
+	uint8_t i;
+
+	for (i = 0; i < KV_HOT_KEYS; i++)
+		kv->hot[i].key = KV_KEY_ERASED;
+	kv->hot_next = 0;
+}
+
+// Offset of the latest record for key in the active page. Active page must be mapped.
+inline uint16_t
+kv_lookup(struct kv_store __xdata * kv, const uint8_t __xdata * page, uint8_t key)
+{
+	uint8_t i;
+	uint16_t off;
+
+	for (i = 0; i < KV_HOT_KEYS; i++)
+		if (kv->hot[i].key == key)
+			return kv->hot[i].offset;
+
+	off = kv_scan_key(page, key, kv->write_off);
+	kv_hot_set(kv, key, off);
+	return off;
+}
+
+inline uint8_t
+kv_write_page_hdr(uint8_t page, uint16_t seq)
+{
+	struct kv_page_hdr hdr;
+
+	hdr.magic = KV_PAGE_MAGIC;
+	hdr.seq = seq;
+	return flash_write(FLASH_WORD_ADDR(page, 0), (const uint8_t *)&hdr, sizeof(hdr));
+}
+
+// Append a record at kv->write_off. The caller has checked that it fits.
+inline uint8_t
+kv_append(struct kv_store __xdata * kv, uint8_t page, uint8_t key, const uint8_t * data, uint8_t len)
+{
+	struct kv_rec_hdr hdr;
+	uint8_t tail[FLASH_WORD_SIZE];
+	uint8_t whole = len & ~(FLASH_WORD_SIZE - 1);
+	uint16_t addr = FLASH_WORD_ADDR(page, kv->write_off);
+	uint8_t i;
+
+	hdr.key = key;
+	hdr.len = len;
+	hdr.crc = kv_rec_crc(&hdr, data);
+
+	if (flash_write(addr, (const uint8_t *)&hdr, sizeof(hdr)))
+		return 1;
+	addr++;
+
+	if (whole) {
+		if (flash_write(addr, data, whole))
+			return 1;
+		addr += whole / FLASH_WORD_SIZE;
+	}
+
+	if (len != whole) {
+		for (i = 0; i < FLASH_WORD_SIZE; i++)
+			tail[i] = (whole + i < len) ? data[whole + i] : 0xFF;
+		if (flash_write(addr, tail, FLASH_WORD_SIZE))
+			return 1;
+	}
+
+	kv->write_off += KV_REC_SIZE(len);
+	return 0;
+}
+
+// Copy the live records of the active page to the next page in the ring and make it active.
+inline uint8_t
+kv_gc(struct kv_store __xdata * kv)
+{
+	uint8_t src = kv_active_page(kv);
+	uint8_t next = (kv->active + 1) % kv->npages;
+	uint8_t dst = kv->first_page + next;
+	uint16_t src_end = kv->write_off;
+	const uint8_t __xdata * page;
+	uint16_t __xdata * latest = kv->scratch->latest;
+	uint8_t __xdata * buf = kv->scratch->buf;
+	uint16_t off;
+	uint8_t i;
+
+	// Find the latest valid record of each key in one pass, checking each CRC once
+	for (i = 0; i < KV_KEY_ERASED; i++)
+		latest[i] = KV_NOT_FOUND;
+	page = flash_page_map(src);
+	for (off = KV_HDR_SIZE; off + KV_HDR_SIZE <= src_end;) {
+		const struct kv_rec_hdr __xdata * rec = (const struct kv_rec_hdr __xdata *)(page + off);
+		uint16_t next_off = off + KV_REC_SIZE(rec->len);
+
+		if (next_off > src_end)
+			break;
+		if (rec->key != KV_KEY_ERASED && rec->crc == kv_rec_crc(rec, (const uint8_t *)(rec + 1)))
+			latest[rec->key] = off;
+		off = next_off;
+	}
+
+	if (flash_erase_page(dst))
+		return 1;
+
+	kv->write_off = KV_HDR_SIZE;
+
+	// Copy them in log order, skipping deleted keys
+	for (off = KV_HDR_SIZE; off + KV_HDR_SIZE <= src_end;) {
+		const struct kv_rec_hdr __xdata * rec;
+		uint8_t key, len;
+		uint16_t rec_off = off;
+
+		page = flash_page_map(src);
+		rec = (const struct kv_rec_hdr __xdata *)(page + off);
+		key = rec->key;
+		len = rec->len;
+		off += KV_REC_SIZE(len);
+		if (off > src_end)
+			break;
+
+		if (!len || key == KV_KEY_ERASED || latest[key] != rec_off)
+			continue;
+
+		for (i = 0; i < len; i++)
+			buf[i] = ((const uint8_t __xdata *)(rec + 1))[i];
+
+		if (kv_append(kv, dst, key, buf, len))
+			goto fail;
+	}
+
+	// The header goes last, so an interrupted collection leaves the old page active
+	if (kv_write_page_hdr(dst, kv->seq + 1))
+		goto fail;
+
+	kv->active = next;
+	kv->seq++;
+	kv_hot_clear(kv);
+	return 0;
+
+fail:
+	kv->write_off = src_end;
+	return 1;
+}
+
+// Find the active page and the end of its log. Formats the store if no valid page is found.
+inline uint8_t
+kv_init(struct kv_store __xdata * kv, uint8_t first_page, uint8_t npages,
+        struct kv_scratch __xdata * scratch)
+{
+	uint8_t memctr = MEMCTR;
+	uint8_t found = 0;
+	uint8_t i;
+	uint8_t err = 0;
+
+	kv->first_page = first_page;
+	kv->npages = npages;
+	kv->scratch = scratch;
+	kv_hot_clear(kv);
+
+	for (i = 0; i < npages; i++) {
+		const struct kv_page_hdr __xdata * hdr =
+			(const struct kv_page_hdr __xdata *)flash_page_map(first_page + i);
+
+		if (hdr->magic != KV_PAGE_MAGIC)
+			continue;
+		if (!found || (int16_t)(hdr->seq - kv->seq) > 0) {
+			kv->active = i;
+			kv->seq = hdr->seq;
+			found = 1;
+		}
+	}
+
+	if (found) {
+		kv->write_off = kv_scan_end(flash_page_map(kv_active_page(kv)));
+	} else {
+		kv->active = 0;
+		kv->seq = 0;
+		kv->write_off = KV_HDR_SIZE;
+		err = flash_erase_page(first_page) || kv_write_page_hdr(first_page, 0);
+	}
+
+	MEMCTR = memctr;
+	return err;
+}
+
+// Copy the value of key into buf. Returns the value length, or -1 if the key is not set.
+inline int16_t
+kv_get(struct kv_store __xdata * kv, uint8_t key, uint8_t * buf, uint8_t maxlen)
+{
+	uint8_t memctr = MEMCTR;
+	const uint8_t __xdata * page = flash_page_map(kv_active_page(kv));
+	uint16_t off = kv_lookup(kv, page, key);
+	int16_t ret = -1;
+
+	if (off != KV_NOT_FOUND) {
+		const struct kv_rec_hdr __xdata * rec = (const struct kv_rec_hdr __xdata *)(page + off);
+		const uint8_t __xdata * data = (const uint8_t __xdata *)(rec + 1);
+		uint8_t i;
+
+		if (rec->len) {
+			ret = rec->len;
+			for (i = 0; i < rec->len && i < maxlen; i++)
+				buf[i] = data[i];
+		}
+	}
+
+	MEMCTR = memctr;
+	return ret;
+}
+
+// Store a value. A zero length deletes the key. Returns nonzero on flash errors.
+inline uint8_t
+kv_put(struct kv_store __xdata * kv, uint8_t key, const uint8_t * data, uint8_t len)
+{
+	uint8_t memctr = MEMCTR;
+	uint16_t off;
+	uint8_t err = 0;
+
+	if (kv->write_off + KV_REC_SIZE(len) > FLASH_PAGE_SIZE) {
+		err = kv_gc(kv);
+		if (!err && kv->write_off + KV_REC_SIZE(len) > FLASH_PAGE_SIZE)
+			err = 1;  // Live data does not leave room for this record
+	}
+
+	if (!err) {
+		off = kv->write_off;
+		err = kv_append(kv, kv_active_page(kv), key, data, len);
+		if (!err)
+			kv_hot_set(kv, key, off);
+	}
+
+	MEMCTR = memctr;
+	return err;
+}
+
+#define kv_del(_kv, _key) kv_put(_kv, _key, 0, 0)
@@ -6,16 +6,7 @@
 #include <compiler.h>
 #include <stdint.h>
 #include "bits.h"
-
-//  R/W    Timer 2 interrupt enable
-// 0: Interrupt disabled # 1: Interrupt enabled
-SBIT(IEN1_T2IE, 0xB8, 2);
-
-//  R/W    Timer 2 interrupt flag.
-// Set to 1 when Timer 2 interrupt occurs and cleared when CPU
-// H0     vectors to the interrupt service routine.
-// 0: Interrupt not pending # 1: Interrupt pending
-SBIT(IRCON_T2IF, 0xC0, 2);
+#include "interrupts.h" // IEN1_T2IE, IRCON_T2IF
 
 // Timer 2 Control Register
 SFR(T2CTRL, 0x94);
@@ -119,3 +110,224 @@ enum T2MSEL_T2OVF {
 		T2M0 = period;                                                            \
 		T2M1 = period >> 8;                                                       \
 	}
+
+inline uint16_t
+mac_timer_get_period(void)
+{
+	uint8_t ea = IEN0_EA;
+	uint8_t sel, l, h;
+
+	IEN0_EA = 0;
+	sel = T2MSEL;
+	mac_timer_select_multiplexed_regs(T2M_PERIOD, T2OVF_PERIOD);
+	l = T2M0;
+	h = T2M1;
+	T2MSEL = sel;
+	IEN0_EA = ea;
+	return ((uint16_t)h << 8) | l;
+}
+
+// Timer count in the low 16 bits and the low 16 bits of the overflow counter in the high 16 bits,
+// latched together. Requires T2CTRL_LATCH_MODE.
+inline uint32_t
+mac_timer_read_raw(void)
+{
+	uint8_t ea = IEN0_EA;
+	uint8_t sel, l, h, o0, o1;
+
+	IEN0_EA = 0;
+	sel = T2MSEL;
+	mac_timer_select_multiplexed_regs(T2M_TIMER, T2OVF_OVERFLOW);
+	l = T2M0;
+	h = T2M1;
+	o0 = T2MOVF0;
+	o1 = T2MOVF1;
+	T2MSEL = sel;
+	IEN0_EA = ea;
+	return ((uint32_t)o1 << 24) | ((uint32_t)o0 << 16) | ((uint16_t)h << 8) | l;
+}
+
+// Ticks from raw stamp a to raw stamp b, for a timer with the given period
+#define mac_timer_raw_elapsed(_a, _b, _period)                                 \
+	((uint32_t)(uint16_t)(((_b) >> 16) - ((_a) >> 16)) * (_period)             \
+	 + (uint16_t)(_b) - (uint16_t)(_a))
+
+/*
+ * 40-bit MAC time base.
+ *
+ * Run with the timer period set to MAC_TIMER_PERIOD (by default the 802.15.4
+ * unit backoff period of 320 us), the 24-bit overflow counter counts periods
+ * and, together with the 16-bit timer, forms a monotonic clock with 31.25 ns
+ * resolution that wraps after 62 days.
+ *
+ * T2MSEL is shared by all accesses to the multiplexed registers, so every access
+ * here is done with interrupts disabled and restores T2MSEL afterwards, and
+ * the timer and overflow counter are latched together (T2CTRL_LATCH_MODE).
+ *
+ * Events at a given time are scheduled in two stages on one of the two compare
+ * channels: the overflow compare fires at the start of the right period, and
+ * mac_timer_irq() then enables the timer compare for the rest of the way.
+ */
+
+// 802.15.4 (2.4 GHz): 16 us per symbol, 20 symbols per unit backoff period
+#define MAC_TIMER_SYMBOL_TICKS 512u
+#define MAC_TIMER_BACKOFF_PERIOD (20u * MAC_TIMER_SYMBOL_TICKS)
+
+#ifndef MAC_TIMER_PERIOD
+#define MAC_TIMER_PERIOD MAC_TIMER_BACKOFF_PERIOD
+#endif
+
+#define MAC_TIMER_OVF_MASK 0xFFFFFFul
+
+struct mac_timer_time {
+	uint32_t ovf;   // Periods (24 bits)
+	uint16_t tim;   // Ticks into the period, < MAC_TIMER_PERIOD
+};
+
+// Start the timer with period MAC_TIMER_PERIOD, from 0
+inline void
+mac_timer_start(void)
+{
+	uint8_t ea = IEN0_EA;
+
+	IEN0_EA = 0;
+	T2CTRL = T2CTRL_LATCH_MODE;
+	mac_timer_set_period(MAC_TIMER_PERIOD);
+	mac_timer_select_multiplexed_regs(T2M_TIMER, T2OVF_OVERFLOW);
+	T2M0 = 0;
+	T2M1 = 0;
+	T2MOVF0 = 0;
+	T2MOVF1 = 0;
+	T2MOVF2 = 0;
+	T2IRQF = 0;
+	T2CTRL = T2CTRL_LATCH_MODE | T2CTRL_RUN;
+	IEN0_EA = ea;
+}
+
+inline void
+mac_timer_read(struct mac_timer_time * t)
+{
+	uint8_t ea = IEN0_EA;
+	uint8_t sel, l, o0, o1;
+
+	IEN0_EA = 0;
+	sel = T2MSEL;
+	mac_timer_select_multiplexed_regs(T2M_TIMER, T2OVF_OVERFLOW);
+	l = T2M0;
+	t->tim = ((uint16_t)T2M1 << 8) | l;
+	o0 = T2MOVF0;
+	o1 = T2MOVF1;
+	t->ovf = ((uint32_t)T2MOVF2 << 16) | ((uint16_t)o1 << 8) | o0;
+	T2MSEL = sel;
+	IEN0_EA = ea;
+}
+
+inline void
+mac_timer_add(struct mac_timer_time * t, uint32_t ticks)
+{
+	uint16_t tim = t->tim + (uint16_t)(ticks % MAC_TIMER_PERIOD);
+
+	t->ovf += ticks / MAC_TIMER_PERIOD;
+	if (tim >= MAC_TIMER_PERIOD) {
+		tim -= MAC_TIMER_PERIOD;
+		t->ovf++;
+	}
+	t->ovf &= MAC_TIMER_OVF_MASK;
+	t->tim = tim;
+}
+
+// Ticks from a to b. Valid for times less than 2^31 ticks (67 s) apart.
+inline int32_t
+mac_timer_diff(const struct mac_timer_time * a, const struct mac_timer_time * b)
+{
+	int32_t ovf = (int32_t)((b->ovf - a->ovf) << 8) >> 8;
+
+	return ovf * (int32_t)MAC_TIMER_PERIOD + (int32_t)b->tim - a->tim;
+}
+
+#define mac_timer_before(_a, _b) (mac_timer_diff(_a, _b) > 0)
+
+// Schedule compare channel n (1 or 2) for time t. Returns nonzero, without
+// scheduling anything, if t is not in the future.
+// The compare registers also drive T2EVTCFG_CMP1/CMP2 events (for DMA and the
+// CSP), which fire once every period at t->tim regardless of the schedule.
+inline uint8_t
+mac_timer_schedule(uint8_t n, const struct mac_timer_time * t)
+{
+	struct mac_timer_time now;
+	uint8_t ea = IEN0_EA;
+	uint8_t sel, late;
+	uint8_t cmp = n == 1 ? T2IRQ_COMPARE1 : T2IRQ_COMPARE2;
+	uint8_t ovf_cmp = n == 1 ? T2IRQ_OVF_COMPARE1 : T2IRQ_OVF_COMPARE2;
+
+	IEN0_EA = 0;
+	sel = T2MSEL;
+	T2MSEL = (T2MSEL_T2M_CMP1 + n - 1) | (T2MSEL_T2OVF_CMP1 + ((n - 1) << 4));
+	T2M0 = t->tim;
+	T2M1 = t->tim >> 8;
+	T2MOVF0 = t->ovf;
+	T2MOVF1 = t->ovf >> 8;
+	T2MOVF2 = t->ovf >> 16;
+	T2MSEL = sel;
+
+	T2IRQM &= ~(cmp | ovf_cmp);
+	T2IRQF = ~(cmp | ovf_cmp);
+	mac_timer_read(&now);
+	late = !mac_timer_before(&now, t);
+	if (!late)
+		T2IRQM |= now.ovf == t->ovf ? cmp : ovf_cmp;
+	IEN1_T2IE = 1;
+	IEN0_EA = ea;
+	return late;
+}
+
+// Cancel a scheduled compare
+#define mac_timer_unschedule(_n)                                               \
+	do {                                                                       \
+		T2IRQM &= (_n) == 1 ? ~(T2IRQ_COMPARE1 | T2IRQ_OVF_COMPARE1)           \
+		                    : ~(T2IRQ_COMPARE2 | T2IRQ_OVF_COMPARE2);          \
+	} while (0)
+
+// Enable the second stage of a schedule, and report the compare as due right
+// away if the timer already passed it while the interrupt was being serviced.
+inline uint8_t
+mac_timer_arm_compare(uint8_t cmp, uint8_t t2m)
+{
+	uint8_t l, due;
+	uint16_t at, now;
+
+	T2MSEL = t2m;
+	l = T2M0;
+	at = ((uint16_t)T2M1 << 8) | l;
+	// The compare flag is set every period, so drop any stale one first
+	T2IRQF = ~cmp;
+	T2IRQM |= cmp;
+	mac_timer_select_multiplexed_regs(T2M_TIMER, T2OVF_OVERFLOW);
+	l = T2M0;
+	now = ((uint16_t)T2M1 << 8) | l;
+	due = now >= at && !(T2IRQF & cmp);
+	if (due)
+		T2IRQM &= ~cmp;
+	return due ? cmp : 0;
+}
+
+// Call from the T2 interrupt handler. Returns the T2IRQ events that happened
+// (scheduled compares fire once and are then disabled).
+inline uint8_t
+mac_timer_irq(void)
+{
+	uint8_t sel = T2MSEL;
+	uint8_t flags = T2IRQF & T2IRQM;
+	uint8_t events = flags & ~(T2IRQ_OVF_COMPARE1 | T2IRQ_OVF_COMPARE2);
+
+	T2IRQF = ~flags;
+	T2IRQM &= ~(flags & (T2IRQ_COMPARE1 | T2IRQ_COMPARE2 | T2IRQ_OVF_COMPARE1 | T2IRQ_OVF_COMPARE2));
+
+	if (flags & T2IRQ_OVF_COMPARE1)
+		events |= mac_timer_arm_compare(T2IRQ_COMPARE1, T2MSEL_T2M_CMP1);
+	if (flags & T2IRQ_OVF_COMPARE2)
+		events |= mac_timer_arm_compare(T2IRQ_COMPARE2, T2MSEL_T2M_CMP2);
+
+	T2MSEL = sel;
+	return events;
+}
@@ -0,0 +1,118 @@
+// SPDX-FileCopyrightText: 2023 Andreas Sig Rosvall
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+#include <compiler.h>
+#include <stdint.h>
+#include "bits.h"
+#include "mac_timer.h"
+#include "sleep_timer.h"
+
+/*
+ * Keep MAC time across PM1/PM2.
+ *
+ * The MAC timer stops when the 32 MHz clock does. With T2CTRL_SYNC set, it
+ * stops and starts exactly at a rising edge of the 32 kHz clock, which is also
+ * when the sleep timer counts. So:
+ *
+ *   mac_timer_sync_stop(&sync);   // MAC time and sleep timer at the same edge
+ *   sleep_enter(PM2);
+ *   ...                           // wait for the 32 MHz crystal
+ *   mac_timer_sync_start(&sync);  // MAC time advanced by the time slept
+ *
+ * restores the MAC timer as if it had kept running. A sleep timer tick is
+ * exactly 976.5625 MAC timer ticks; the fraction is carried from one sleep to
+ * the next, so the error does not grow with the number of sleeps and stays
+ * within one MAC timer tick plus the 32 kHz clock error. For guard times in the
+ * tens of microseconds, run the sleep timer from the 32 kHz crystal, not the RC
+ * oscillator.
+ */
+
+// Sleep timer ticks between computing the new MAC time and the start edge.
+// Must cover the time the computation takes at the current CPU clock.
+#ifndef MAC_TIMER_SYNC_LEAD
+#define MAC_TIMER_SYNC_LEAD 4
+#endif
+
+// MAC timer ticks per sleep timer tick: 32 MHz / 32768 Hz = 976 + 9/16
+#define MAC_TIMER_SYNC_TICKS_INT  976u
+#define MAC_TIMER_SYNC_TICKS_FRAC 9u
+
+// Largest number of sleep timer ticks converted at once (4096000000 MAC timer ticks)
+#define MAC_TIMER_SYNC_CHUNK 0x400000ul
+
+struct mac_timer_sync {
+	struct mac_timer_time t;  // MAC time at the stop edge
+	uint32_t st;              // Sleep timer at the stop edge
+	uint8_t frac;             // Sixteenths of a MAC timer tick carried over
+};
+
+// Stop the MAC timer at the next 32 kHz edge and record the time
+inline void
+mac_timer_sync_stop(struct mac_timer_sync __xdata * s)
+{
+	T2CTRL = T2CTRL_LATCH_MODE | T2CTRL_SYNC;
+	while (T2CTRL & T2CTRL_STATE);
+	s->st = sleep_timer_read();
+	mac_timer_read(&s->t);
+}
+
+// Advance t by n sleep timer ticks
+inline void
+mac_timer_sync_advance(struct mac_timer_time * t, uint32_t n, uint8_t * frac)
+{
+	uint32_t f;
+
+	while (n > MAC_TIMER_SYNC_CHUNK) {
+		mac_timer_add(t, MAC_TIMER_SYNC_CHUNK * MAC_TIMER_SYNC_TICKS_INT
+		                 + MAC_TIMER_SYNC_CHUNK * MAC_TIMER_SYNC_TICKS_FRAC / 16);
+		n -= MAC_TIMER_SYNC_CHUNK;
+	}
+	f = n * MAC_TIMER_SYNC_TICKS_FRAC + *frac;
+	*frac = f & 15;
+	mac_timer_add(t, n * MAC_TIMER_SYNC_TICKS_INT + (f >> 4));
+}
+
+// Load the MAC timer while it is stopped
+inline void
+mac_timer_load(const struct mac_timer_time * t)
+{
+	mac_timer_select_multiplexed_regs(T2M_TIMER, T2OVF_OVERFLOW);
+	T2M0 = t->tim;
+	T2M1 = t->tim >> 8;
+	T2MOVF0 = t->ovf;
+	T2MOVF1 = t->ovf >> 8;
+	T2MOVF2 = t->ovf >> 16;
+}
+
+// Restart the MAC timer after sleep, at MAC time advanced by the time since
+// mac_timer_sync_stop(). Requires the 32 MHz crystal to be running.
+// Call with interrupts disabled.
+inline void
+mac_timer_sync_start(struct mac_timer_sync __xdata * s)
+{
+	struct mac_timer_time t;
+	uint32_t now, target;
+	uint8_t frac;
+
+	sleep_timer_wait_edge();
+	for (;;) {
+		now = sleep_timer_read();
+		target = (now + MAC_TIMER_SYNC_LEAD) & SLEEP_TIMER_MASK;
+		t = s->t;
+		frac = s->frac;
+		mac_timer_sync_advance(&t, sleep_timer_diff(s->st, target), &frac);
+		mac_timer_load(&t);
+
+		// Start during the tick before the target edge; if the computation
+		// took too long for that, try again with a later edge
+		if (sleep_timer_diff(now, sleep_timer_read()) < MAC_TIMER_SYNC_LEAD - 1)
+			break;
+	}
+	while (sleep_timer_diff(now, sleep_timer_read()) < MAC_TIMER_SYNC_LEAD - 1);
+	T2CTRL = T2CTRL_LATCH_MODE | T2CTRL_SYNC | T2CTRL_RUN;
+
+	s->frac = frac;
+	while (!(T2CTRL & T2CTRL_STATE));
+}
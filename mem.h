@@ -31,6 +31,9 @@ SFR(MEMCTR, 0xC7);
 // (0x8000 + SRAM_SIZE - 1). This enables execution of program code from RAM.
 #define MEMCTR_XMAP BIT(3)
 
+// Code address at which an SRAM xdata address executes when MEMCTR_XMAP is set
+#define XMAP_CODE_ADDR(_xdata_addr) (0x8000u + (uint16_t)(_xdata_addr))
+
 #define XBANK_SIZE 0x8000u
 #define FLASH_MAPPING_IN_XDATA 0x8000u
 #define SFR_MAPPING_IN_XDATA 0x7000u
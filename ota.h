@@ -0,0 +1,272 @@
+// SPDX-FileCopyrightText: 2023 Andreas Sig Rosvall
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+#include <compiler.h>
+#include <stdint.h>
+#include "bits.h"
+#include "crc.h"
+#include "flash.h"
+#include "mem.h"
+
+/*
+ * Resumable firmware image update.
+ *
+ * The image is received in fixed-size chunks, in any order, into an inactive
+ * (staging) flash region. A metadata page records the image size and CRC-32 and
+ * one word per chunk, written to 0 once the chunk is programmed. After a
+ * reset, ota_begin() with the same size and CRC picks up where the transfer left
+ * off, and ota_next_missing() tells which chunks still need to be fetched.
+ *
+ * Once all chunks are in, ota_verify() checks the CRC over the staging region and
+ * marks the image verified. ota_apply(), run early at boot from code outside the
+ * active region (e.g. a bootloader), then copies the staging region over the
+ * active one. The staging copy is kept until the copy has completed, so a reset
+ * during ota_apply() simply restarts the copy.
+ *
+ * Metadata page layout: [size] [crc] [state] [chunk words...]
+ * Chunk words are written once between erases, as in frame_counter.h, so the
+ * number of chunks is limited by the words in the metadata page: with 2 KB
+ * pages and the default 256 byte chunks, images up to 127 KB.
+ */
+
+#ifndef OTA_CHUNK_SIZE
+#define OTA_CHUNK_SIZE 256u
+#endif
+
+#if (FLASH_PAGE_SIZE % OTA_CHUNK_SIZE) || (OTA_CHUNK_SIZE % FLASH_WORD_SIZE)
+#error "OTA_CHUNK_SIZE must be a multiple of FLASH_WORD_SIZE that divides FLASH_PAGE_SIZE"
+#endif
+
+#define OTA_CHUNKS_PER_PAGE (FLASH_PAGE_SIZE / OTA_CHUNK_SIZE)
+
+enum ota_meta_word {
+	OTA_META_SIZE   = 0,
+	OTA_META_CRC    = 1,
+	OTA_META_STATE  = 2,
+	OTA_META_CHUNKS = 3,
+};
+
+// State bits, cleared as the update progresses
+enum {
+	OTA_STATE_VERIFIED = BIT(0),
+	OTA_STATE_APPLIED  = BIT(1),
+};
+
+#define OTA_MAX_CHUNKS ((uint16_t)(FLASH_PAGE_WORDS - OTA_META_CHUNKS))
+
+struct ota {
+	uint8_t meta_page;
+	uint8_t first_page;  // First page of the staging region
+	uint8_t npages;      // Size of the staging region
+	uint32_t size;
+	uint32_t crc;
+	uint16_t nchunks;
+	uint16_t missing;    // Chunks not yet programmed
+};
+
+#define ota_chunk_addr(_ota, _idx)                                             \
+	FLASH_WORD_ADDR((_ota)->first_page + (_idx) / OTA_CHUNKS_PER_PAGE,         \
+	                ((_idx) % OTA_CHUNKS_PER_PAGE) * OTA_CHUNK_SIZE)
+
+inline uint32_t
+ota_meta_read(struct ota __xdata * ota, uint16_t word)
+{
+	uint8_t memctr = MEMCTR;
+	uint32_t w = ((const uint32_t __xdata *)flash_page_map(ota->meta_page))[word];
+
+	MEMCTR = memctr;
+	return w;
+}
+
+inline uint8_t
+ota_meta_write(struct ota __xdata * ota, uint16_t word, uint32_t w)
+{
+	return flash_write(FLASH_WORD_ADDR(ota->meta_page, 0) + word, (const uint8_t *)&w, sizeof(w));
+}
+
+// Clear bits in a metadata word
+inline uint8_t
+ota_meta_clear(struct ota __xdata * ota, uint16_t word, uint32_t bits)
+{
+	return ota_meta_write(ota, word, ota_meta_read(ota, word) & ~bits);
+}
+
+#define ota_chunk_word(_idx) (OTA_META_CHUNKS + (_idx))
+
+// Any chunk word that is not erased counts as done
+inline uint8_t
+ota_chunk_done(struct ota __xdata * ota, uint16_t idx)
+{
+	return ota_meta_read(ota, ota_chunk_word(idx)) != 0xFFFFFFFFul;
+}
+
+// Start receiving an image of size bytes with the given CRC-32 into the staging region.
+// Resumes a previous transfer of the same image, otherwise erases the staging region.
+// Returns nonzero if the image does not fit or on flash errors.
+inline uint8_t
+ota_begin(struct ota __xdata * ota, uint8_t meta_page, uint8_t first_page, uint8_t npages,
+          uint32_t size, uint32_t crc)
+{
+	uint32_t nchunks = size / OTA_CHUNK_SIZE + (size % OTA_CHUNK_SIZE ? 1 : 0);
+	uint16_t i;
+
+	if (!size || size > (uint32_t)npages * FLASH_PAGE_SIZE
+	    || nchunks > OTA_MAX_CHUNKS || nchunks > (uint32_t)npages * OTA_CHUNKS_PER_PAGE)
+		return 1;
+
+	ota->meta_page = meta_page;
+	ota->first_page = first_page;
+	ota->npages = npages;
+	ota->size = size;
+	ota->crc = crc;
+	ota->nchunks = nchunks;
+
+	if (ota_meta_read(ota, OTA_META_SIZE) != size || ota_meta_read(ota, OTA_META_CRC) != crc) {
+		// The metadata goes first, so a previously verified image is never
+		// applied from a partly erased staging region, and size and CRC are
+		// written last, so a transfer is only resumed into an erased region.
+		if (flash_erase_page(meta_page))
+			return 1;
+		for (i = 0; i < npages; i++)
+			if (flash_erase_page(first_page + i))
+				return 1;
+		if (ota_meta_write(ota, OTA_META_SIZE, size)
+		    || ota_meta_write(ota, OTA_META_CRC, crc))
+			return 1;
+	}
+
+	ota->missing = 0;
+	for (i = 0; i < ota->nchunks; i++)
+		if (!ota_chunk_done(ota, i))
+			ota->missing++;
+	return 0;
+}
+
+// Program chunk idx from data (OTA_CHUNK_SIZE bytes; the last chunk may be short,
+// down to the end of the image).
+// Chunks already programmed are ignored.
+inline uint8_t
+ota_write_chunk(struct ota __xdata * ota, uint16_t idx, const uint8_t __xdata * data)
+{
+	uint16_t addr = ota_chunk_addr(ota, idx);
+	uint16_t len = OTA_CHUNK_SIZE;
+	uint16_t whole;
+	uint8_t tail[FLASH_WORD_SIZE];
+	uint8_t i;
+
+	if (idx >= ota->nchunks)
+		return 1;
+	if (ota_chunk_done(ota, idx))
+		return 0;
+
+	if (idx == ota->nchunks - 1 && ota->size % OTA_CHUNK_SIZE)
+		len = ota->size % OTA_CHUNK_SIZE;
+	whole = len & ~(FLASH_WORD_SIZE - 1);
+
+	if (whole && flash_write(addr, data, whole))
+		return 1;
+	// Pad a partial last word, without reading past the end of data
+	if (len != whole) {
+		for (i = 0; i < FLASH_WORD_SIZE; i++)
+			tail[i] = (whole + i < len) ? data[whole + i] : 0xFF;
+		if (flash_write(addr + whole / FLASH_WORD_SIZE, tail, FLASH_WORD_SIZE))
+			return 1;
+	}
+
+	if (ota_meta_write(ota, ota_chunk_word(idx), 0))
+		return 1;
+
+	ota->missing--;
+	return 0;
+}
+
+// First chunk at or after idx that has not been programmed, or nchunks if none.
+inline uint16_t
+ota_next_missing(struct ota __xdata * ota, uint16_t idx)
+{
+	for (; idx < ota->nchunks; idx++)
+		if (!ota_chunk_done(ota, idx))
+			break;
+	return idx;
+}
+
+// CRC-32 over size bytes of a flash region starting at first_page
+inline uint32_t
+ota_region_crc(uint8_t first_page, uint32_t size)
+{
+	uint8_t memctr = MEMCTR;
+	uint32_t crc = CRC32_INIT;
+	uint8_t page = first_page;
+
+	while (size) {
+		const uint8_t __xdata * p = flash_page_map(page++);
+		uint16_t n = size > FLASH_PAGE_SIZE ? FLASH_PAGE_SIZE : size;
+
+		size -= n;
+		while (n--)
+			crc = crc32_update(crc, *p++);
+	}
+
+	MEMCTR = memctr;
+	return ~crc;
+}
+
+// Check the received image and mark it for ota_apply().
+inline uint8_t
+ota_verify(struct ota __xdata * ota)
+{
+	if (ota->missing || ota_region_crc(ota->first_page, ota->size) != ota->crc)
+		return 1;
+	return ota_meta_clear(ota, OTA_META_STATE, OTA_STATE_VERIFIED);
+}
+
+// Copy a verified image from the staging region over the active region.
+// Returns 0 if there was nothing to do or the copy succeeded, and nonzero
+// without touching the active region if the staging region fails its CRC.
+// Must run from code outside the active region. buf (OTA_CHUNK_SIZE bytes) is
+// scratch space for the copy, e.g. an overlay region (see overlay.h).
+inline uint8_t
+ota_apply(uint8_t meta_page, uint8_t staging_page, uint8_t active_page, uint8_t __xdata * buf)
+{
+	uint8_t memctr = MEMCTR;
+	const uint32_t __xdata * meta = (const uint32_t __xdata *)flash_page_map(meta_page);
+	uint32_t size = meta[OTA_META_SIZE];
+	uint32_t crc = meta[OTA_META_CRC];
+	uint32_t state = meta[OTA_META_STATE];
+	uint8_t err = 0;
+	uint8_t page;
+
+	if ((state & OTA_STATE_VERIFIED) || !(state & OTA_STATE_APPLIED))
+		goto out;
+
+	// Check the staging region again before overwriting anything
+	if (ota_region_crc(staging_page, size) != crc) {
+		err = 1;
+		goto out;
+	}
+
+	for (page = 0; !err && (uint32_t)page * FLASH_PAGE_SIZE < size; page++) {
+		uint16_t off;
+
+		err = flash_erase_page(active_page + page);
+		for (off = 0; !err && off < FLASH_PAGE_SIZE; off += OTA_CHUNK_SIZE) {
+			const uint8_t __xdata * src = flash_page_map(staging_page + page) + off;
+			uint16_t i;
+
+			for (i = 0; i < OTA_CHUNK_SIZE; i++)
+				buf[i] = src[i];
+			err = flash_write(FLASH_WORD_ADDR(active_page + page, off), buf, OTA_CHUNK_SIZE);
+		}
+	}
+
+	if (!err) {
+		uint32_t w = state & ~(uint32_t)OTA_STATE_APPLIED;
+		err = flash_write(FLASH_WORD_ADDR(meta_page, 0) + OTA_META_STATE, (const uint8_t *)&w, sizeof(w));
+	}
+
+out:
+	MEMCTR = memctr;
+	return err;
+}
@@ -0,0 +1,143 @@
+// SPDX-FileCopyrightText: 2023 Andreas Sig Rosvall
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+#include <compiler.h>
+#include <stdint.h>
+#include "bits.h"
+#include "interrupts.h"
+#include "mem.h"
+
+/*
+ * Shared xdata for subsystems that are never active at the same time.
+ *
+ * An overlay region is a union of the buffers of its users, so it costs the
+ * size of the largest one instead of the sum. The users are listed with the
+ * set of application phases (bits) in which each can be active, and
+ * OVERLAY_REGION() builds the union from the list and checks at compile time
+ * that no two users of the region share a phase:
+ *
+ *   #define PHASE_BOOT   BIT(0)
+ *   #define PHASE_JOIN   BIT(1)
+ *   #define PHASE_NORMAL BIT(2)
+ *
+ *   #define SCRATCH_USERS(_user)                                  \
+ *       _user(ota,  struct ota_buf,  PHASE_BOOT)                  \
+ *       _user(scan, struct scan_buf, PHASE_JOIN)                  \
+ *       _user(aes,  struct aes_buf,  PHASE_JOIN | PHASE_NORMAL)
+ *
+ *   OVERLAY_REGION(scratch, SCRATCH_USERS);           // In a header
+ *   OVERLAY_DEFINE(scratch, union scratch_users);     // In one source file
+ *
+ *   scratch.scan.rssi[i] = ...;
+ *
+ * Anything not expressible as phases (e.g. a subsystem that is started on
+ * demand) is caught at run time with overlay_acquire() and overlay_release().
+ *
+ * Within a region, an arena hands out variable-sized blocks that are all freed
+ * together, e.g. at the end of a phase.
+ *
+ * The top 256 bytes of SRAM hold the 8051 data space (see mmap_idata_to_xdata()),
+ * so xdata allocations must end below OVERLAY_XDATA_END.
+ */
+
+#ifndef OVERLAY_SRAM_SIZE
+#define OVERLAY_SRAM_SIZE 0x2000u  // See chipinfo_read_sram_size_kb()
+#endif
+#define OVERLAY_XDATA_END (OVERLAY_SRAM_SIZE - 0x100u)
+
+#define OVERLAY_FREE 0
+
+#define OVERLAY_DECLARE(_name, _type)                                          \
+	extern __xdata _type _name;                                                \
+	extern __xdata volatile uint8_t _name##_owner
+
+#define OVERLAY_DEFINE(_name, _type)                                           \
+	__xdata _type _name;                                                       \
+	__xdata volatile uint8_t _name##_owner
+
+// Place a region at a fixed address (e.g. at the top of the usable SRAM)
+#define OVERLAY_DEFINE_AT(_name, _type, _addr)                                 \
+	_Static_assert((_addr) + sizeof(_type) <= OVERLAY_XDATA_END,               \
+	               #_name " overlaps the idata mapping");                      \
+	__xdata __at(_addr) _type _name;                                           \
+	__xdata volatile uint8_t _name##_owner
+
+#define OVERLAY_MEMBER_(_user, _type, _phases) _type _user;
+#define OVERLAY_PHASES_OR_(_user, _type, _phases) | (uint32_t)(_phases)
+#define OVERLAY_PHASES_SUM_(_user, _type, _phases) + (uint32_t)(_phases)
+
+// Declare region _name shared by the users in _list, a list of _user(name, type, phases).
+// The phase sets are disjoint exactly when their sum equals their union.
+#define OVERLAY_REGION(_name, _list)                                           \
+	union _name##_users {                                                      \
+		_list(OVERLAY_MEMBER_)                                                 \
+	};                                                                         \
+	_Static_assert((0 _list(OVERLAY_PHASES_OR_)) == (0 _list(OVERLAY_PHASES_SUM_)), \
+	               "users of overlay " #_name " active in the same phase");    \
+	OVERLAY_DECLARE(_name, union _name##_users)
+
+// The region as a given user type
+#define OVERLAY_AS(_name, _type) ((_type __xdata *)&(_name))
+
+// Claim a region for user id (nonzero). Returns nonzero if another user holds it.
+#define overlay_acquire(_name, _id) overlay_acquire_owner(&_name##_owner, (_id))
+
+#define overlay_release(_name, _id)                                            \
+	do {                                                                       \
+		if (_name##_owner == (_id))                                            \
+			_name##_owner = OVERLAY_FREE;                                      \
+	} while (0)
+
+// Current user of a region, or OVERLAY_FREE
+#define overlay_owner(_name) (_name##_owner)
+
+inline uint8_t
+overlay_acquire_owner(__xdata volatile uint8_t * owner, uint8_t id)
+{
+	uint8_t ea = IEN0_EA;
+	uint8_t busy;
+
+	IEN0_EA = 0;
+	busy = *owner != OVERLAY_FREE && *owner != id;
+	if (!busy)
+		*owner = id;
+	IEN0_EA = ea;
+	return busy;
+}
+
+struct overlay_arena {
+	uint8_t __xdata * base;
+	uint16_t size;
+	uint16_t used;
+};
+
+#define overlay_arena_init(_arena, _name)                                      \
+	do {                                                                       \
+		(_arena)->base = (uint8_t __xdata *)&(_name);                          \
+		(_arena)->size = sizeof(_name);                                        \
+		(_arena)->used = 0;                                                    \
+	} while (0)
+
+// Allocate n bytes, or NULL if the arena is full
+inline void __xdata *
+overlay_arena_alloc(struct overlay_arena * arena, uint16_t n)
+{
+	uint8_t __xdata * p = arena->base + arena->used;
+
+	if (n > arena->size - arena->used)
+		return 0;
+	arena->used += n;
+	return p;
+}
+
+// Free everything allocated after a mark
+#define overlay_arena_mark(_arena) ((_arena)->used)
+#define overlay_arena_release(_arena, _mark) ((_arena)->used = (_mark))
+#define overlay_arena_reset(_arena) overlay_arena_release(_arena, 0)
+
+// Run-time check of a region against the SRAM size of the actual chip
+#define overlay_fits_sram(_name)                                               \
+	((uint16_t)&(_name) + sizeof(_name)                                        \
+	 <= (uint16_t)chipinfo_read_sram_size_kb() * 1024u - 0x100u)
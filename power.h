@@ -0,0 +1,173 @@
+// SPDX-FileCopyrightText: 2023 Andreas Sig Rosvall
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+#include <compiler.h>
+#include <stdint.h>
+#include "bits.h"
+#include "clock.h"
+#include "dma.h"
+#include "interrupts.h"
+#include "sleep.h"
+#include "sleep_timer.h"
+#include "usart.h"
+#include "usb.h"
+
+/*
+ * Power mode selection on idle.
+ *
+ * power_idle() is called whenever there is nothing to do, with the time to the
+ * next timer deadline, and enters the deepest power mode that is safe now:
+ *
+ *   IDLE  the CPU stops, everything else runs. Used while DMA channels are
+ *         armed, a USART is transferring, the USB PLL runs, or the deadline is
+ *         too close for PM1 to pay off.
+ *   PM1   the 32 MHz clocks stop, the voltage regulator stays on: fast wakeup.
+ *   PM2   the regulator is off too. Only for deadlines far enough away to
+ *         cover the longer wakeup.
+ *   PM3   the sleep timer stops as well. Only with no deadline at all, and an
+ *         I/O interrupt enabled to wake up; otherwise IDLE, so that any other
+ *         interrupt still can.
+ *
+ * Anything else that must not sleep, e.g. the radio while receiving, takes a
+ * hold that limits the mode:
+ *
+ *   power_hold(&pm, POWER_PM1);      // nothing from PM1 down
+ *   ...
+ *   power_release(&pm, POWER_PM1);
+ *
+ *   for (;;) {
+ *       interrupts_disable();
+ *       if (!work_pending())
+ *           power_idle(&pm, ticks_to_next_timer());
+ *       interrupts_enable();
+ *       do_work();
+ *   }
+ *
+ * Before PM1-3, the system clock is switched to the 16 MHz RC oscillator, as
+ * it is when waking up, and the saved CLKCONCMD is restored after wakeup, which
+ * waits for the 32 MHz crystal. The interrupt that wakes the chip is serviced
+ * before that, on the RC oscillator. Keeping the MAC timer across sleep is up
+ * to the caller (see mac_timer_sync.h).
+ */
+
+// Sleep timer ticks to the deadline for which PM1 and PM2 pay off, including
+// wakeup time. The sleep timer compare must be at least 5 ticks ahead.
+#ifndef POWER_PM1_MIN_TICKS
+#define POWER_PM1_MIN_TICKS 5ul
+#endif
+#ifndef POWER_PM2_MIN_TICKS
+#define POWER_PM2_MIN_TICKS 33ul   // About 1 ms
+#endif
+
+#define POWER_NO_DEADLINE 0xFFFFFFFFul
+
+enum power_mode {
+	POWER_IDLE = 0,
+	POWER_PM1  = 1,
+	POWER_PM2  = 2,
+	POWER_PM3  = 3,
+};
+
+struct power {
+	uint8_t holds[4];        // holds[m]: number of holds forbidding mode m and deeper
+	uint16_t entries[4];     // Times each mode was entered
+};
+
+inline void
+power_init(struct power __xdata * pm)
+{
+	uint8_t i;
+
+	for (i = 0; i < 4; i++) {
+		pm->holds[i] = 0;
+		pm->entries[i] = 0;
+	}
+}
+
+// Forbid mode _mode (POWER_PM1-3) and deeper until released. Safe to use from ISRs.
+#define power_hold(_pm, _mode)                                                 \
+	do {                                                                       \
+		uint8_t _ea = IEN0_EA;                                                 \
+		IEN0_EA = 0;                                                           \
+		(_pm)->holds[_mode]++;                                                 \
+		IEN0_EA = _ea;                                                         \
+	} while (0)
+
+#define power_release(_pm, _mode)                                              \
+	do {                                                                       \
+		uint8_t _ea = IEN0_EA;                                                 \
+		IEN0_EA = 0;                                                           \
+		(_pm)->holds[_mode]--;                                                 \
+		IEN0_EA = _ea;                                                         \
+	} while (0)
+
+// Any I/O interrupt enabled that can wake the chip from PM3
+#define power_io_wake() (IEN1_P0IE || (IEN2 & (IEN2_P1IE | IEN2_P2IE)))
+
+// Deepest safe mode with ticks (sleep timer) to the next deadline
+inline uint8_t
+power_choose(struct power __xdata * pm, uint32_t ticks)
+{
+	uint8_t mode, m;
+
+	if ((DMAARM & 0x1F) || (U0CSR & UXCSR_ACTIVE) || (U1CSR & UXCSR_ACTIVE))
+		return POWER_IDLE;
+	// The USB PLL must be stopped before leaving active mode
+	if ((USB.ctrl & USBCTRL_USB_EN) && (USB.ctrl & USBCTRL_PLL_EN))
+		return POWER_IDLE;
+
+	if (ticks == POWER_NO_DEADLINE)
+		mode = power_io_wake() ? POWER_PM3 : POWER_IDLE;
+	else if (!IEN0_STIE || ticks < POWER_PM1_MIN_TICKS)
+		return POWER_IDLE;
+	else if (ticks < POWER_PM2_MIN_TICKS)
+		mode = POWER_PM1;
+	else
+		mode = POWER_PM2;
+
+	for (m = POWER_PM1; m <= mode; m++) {
+		if (pm->holds[m])
+			return m - 1;
+	}
+	return mode;
+}
+
+// Enter the mode chosen by power_choose(). Call with interrupts disabled, after
+// checking that there is nothing to do. Returns with interrupts enabled and the
+// clock restored, after the wakeup interrupt has been serviced.
+inline uint8_t
+power_idle(struct power __xdata * pm, uint32_t ticks)
+{
+	uint8_t mode = power_choose(pm, ticks);
+	uint8_t clk;
+
+	pm->entries[mode]++;
+	if (mode == POWER_IDLE) {
+		sleep_enter(ACTIVE);
+		return mode;
+	}
+
+	clk = CLKCONCMD;
+	CLKCONCMD = clk | CLK_OSC_16MHZ_RC;
+	while (!(CLKCONSTA & CLK_OSC_16MHZ_RC));
+
+	// A sleep timer compare value still being loaded would be lost
+	while (!(STLOAD & STLOAD_LDRDY));
+	switch (mode) {
+	case POWER_PM1:
+		sleep_enter(PM1);
+		break;
+	case POWER_PM2:
+		sleep_enter(PM2);
+		break;
+	default:
+		sleep_enter(PM3);
+		break;
+	}
+
+	CLKCONCMD = clk;
+	while (CLKCONSTA != clk);
+	return mode;
+}
@@ -0,0 +1,175 @@
+// SPDX-FileCopyrightText: 2023 Andreas Sig Rosvall
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+#include <compiler.h>
+#include <stdint.h>
+#include "bits.h"
+#include "interrupts.h"
+
+/*
+ * Section profiler on an 8-bit timer.
+ *
+ * Timer 4 (or Timer 3 with PROF_TIMER=3) runs free and its overflow interrupt
+ * counts the high 16 bits of a 24-bit timestamp. With TICKSPD equal to CLKSPD
+ * and PROF_DIV_SHIFT 0, a timestamp tick is a CPU cycle. The overflow
+ * interrupt then fires every 256 cycles, which costs about a tenth of the CPU
+ * and is counted in the sections it interrupts; the default divider of 8 keeps
+ * that around one percent at 8 cycle resolution.
+ *
+ * Sections are numbered by the application (e.g. an enum) and record count,
+ * min, max and total time, with the cost of the measurement itself removed:
+ *
+ *   void t4_isr(void) __interrupt(INTR_T4) { prof_irq(&prof); }
+ *
+ *   prof_init(&prof);
+ *   ...
+ *   PROF_BEGIN(&prof, PROF_RX);
+ *   handle_rx();
+ *   PROF_END(&prof, PROF_RX);
+ *
+ * A section must not be longer than the 24-bit timestamp range (0.5 s of
+ * cycles at 32 MHz, times the divider). Timestamps can be taken inside other
+ * ISRs and with interrupts disabled, as long as that lasts less than half a
+ * timer period.
+ */
+
+#ifndef PROF_SECTIONS
+#define PROF_SECTIONS 8
+#endif
+#ifndef PROF_TIMER
+#define PROF_TIMER 4
+#endif
+#ifndef PROF_DIV_SHIFT
+#define PROF_DIV_SHIFT 3  // Timer ticks are 2^PROF_DIV_SHIFT ticks of TICKSPD
+#endif
+
+#if PROF_TIMER == 4
+#include "timer4.h"
+#define PROF_CNT       T4CNT
+#define PROF_CTL       T4CTL
+#define PROF_OVFIF     TIMIF_T4OVFIF
+#define PROF_IE        IEN1_T4IE
+#define PROF_CTL_START (T4CTL_MODE_FREE_RUNNING | T4CTL_OVFIM | T4CTL_START)
+#define PROF_CTL_CLR   T4CTL_CLR
+#elif PROF_TIMER == 3
+#include "timer3.h"
+#define PROF_CNT       T3CNT
+#define PROF_CTL       T3CTL
+#define PROF_OVFIF     TIMIF_T3OVFIF
+#define PROF_IE        IEN1_T3IE
+#define PROF_CTL_START (T3CTL_MODE_FREE_RUNNING | T3CTL_OVFIM | T3CTL_START)
+#define PROF_CTL_CLR   T3CTL_CLR
+#else
+#error "PROF_TIMER must be 3 or 4"
+#endif
+
+#if PROF_DIV_SHIFT > 7
+#error "PROF_DIV_SHIFT must be 0-7"
+#endif
+
+#define PROF_MASK 0xFFFFFFul
+
+struct prof_section {
+	uint32_t total;       // Sum of all durations, stops when it would overflow
+	uint32_t min;
+	uint32_t max;
+	uint16_t count;       // Number of durations in total
+	uint16_t dropped;     // Durations not added to total and count
+};
+
+struct prof {
+	volatile uint16_t ovf;
+	uint8_t overhead;     // Ticks measured for an empty section
+	struct prof_section sec[PROF_SECTIONS];
+};
+
+// Call from the timer ISR. The ISR flag is cleared by hardware, the overflow flag is not.
+#define prof_irq(_p)                                                           \
+	do {                                                                       \
+		if (PROF_OVFIF) {                                                      \
+			PROF_OVFIF = 0;                                                    \
+			(_p)->ovf++;                                                       \
+		}                                                                      \
+	} while (0)
+
+// 24-bit timestamp
+inline uint32_t
+prof_now(struct prof __xdata * p)
+{
+	uint8_t ea = IEN0_EA;
+	uint8_t lo;
+	uint16_t hi;
+
+	IEN0_EA = 0;
+	lo = PROF_CNT;
+	hi = p->ovf;
+	// An overflow that happened before lo was read, but is not counted yet
+	if (PROF_OVFIF && !(lo & 0x80))
+		hi++;
+	IEN0_EA = ea;
+	return ((uint32_t)hi << 8) | lo;
+}
+
+#define prof_elapsed(_t0, _t1) (((_t1) - (_t0)) & PROF_MASK)
+
+inline void
+prof_reset(struct prof __xdata * p)
+{
+	uint8_t i;
+
+	for (i = 0; i < PROF_SECTIONS; i++) {
+		p->sec[i].total = 0;
+		p->sec[i].min = PROF_MASK;
+		p->sec[i].max = 0;
+		p->sec[i].count = 0;
+		p->sec[i].dropped = 0;
+	}
+}
+
+inline void
+prof_record(struct prof __xdata * p, uint8_t sec, uint32_t t)
+{
+	struct prof_section __xdata * s = &p->sec[sec];
+
+	t = t > p->overhead ? t - p->overhead : 0;
+	if (t < s->min)
+		s->min = t;
+	if (t > s->max)
+		s->max = t;
+	if (s->count == 0xFFFF || s->total + t < s->total) {
+		s->dropped++;
+		return;
+	}
+	s->total += t;
+	s->count++;
+}
+
+#define PROF_BEGIN(_p, _sec) uint32_t prof_t0_##_sec = prof_now(_p)
+#define PROF_END(_p, _sec)                                                     \
+	prof_record((_p), (_sec), prof_elapsed(prof_t0_##_sec, prof_now(_p)))
+
+// Start the timer and measure the cost of an empty section.
+// The timer's interrupt must not be used for anything else.
+inline void
+prof_init(struct prof __xdata * p)
+{
+	uint32_t t0;
+
+	PROF_IE = 0;
+	PROF_CTL = PROF_CTL_CLR;
+	p->ovf = 0;
+	PROF_OVFIF = 0;
+	PROF_CTL = PROF_CTL_START | (PROF_DIV_SHIFT << 5);
+	PROF_IE = 1;
+
+	p->overhead = 0;
+	t0 = prof_now(p);
+	p->overhead = prof_elapsed(t0, prof_now(p));
+	prof_reset(p);
+}
+
+#define prof_avg(_s) ((_s)->count ? (_s)->total / (_s)->count : 0)
+// Timer ticks to TICKSPD ticks (CPU cycles when TICKSPD equals CLKSPD)
+#define prof_cycles(_t) ((uint32_t)(_t) << PROF_DIV_SHIFT)
@@ -0,0 +1,108 @@
+// SPDX-FileCopyrightText: 2023 Andreas Sig Rosvall
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+#include <compiler.h>
+#include <stdint.h>
+#include "bits.h"
+#include "dma.h"
+#include "timer1.h"
+
+/*
+ * PWM waveforms from a table of compare values.
+ *
+ * Timer 1 runs in modulo mode with the period in T1CC0, and channel 1 or 2
+ * drives its pin high at 0 and low on compare, so T1CCn is the high time of
+ * the period. The compare event of the channel triggers a DMA channel that
+ * writes the next table entry to T1CCn. Compare values written in compare mode
+ * take effect when the counter wraps to 0, so each entry lasts exactly one
+ * period. The first entry is loaded by pwm_dma_start() and the DMA channel
+ * writes each next one during the period before it plays. In repeated mode
+ * the table loops forever; otherwise the output stops changing after the last
+ * entry. Either way, no CPU time is spent per period.
+ *
+ *   pwm_dma_setup(&dma_conf[1], 1, table, n, REPEAT);
+ *   dma_arm(1);
+ *   pwm_dma_start(1, DIV1, period, table, n, REPEAT);
+ *
+ * One-shot tables need at least 2 entries.
+ *
+ * Routing the channel to its pin (PERCFG, PxSEL) is left to the application.
+ */
+
+// The entry pwm_dma_start() loads, and where the DMA channel continues from.
+// A one-shot table plays from entry 0, so DMA starts at entry 1. A repeated
+// table is played from entry n - 1, so that DMA can loop over the whole table.
+#define PWM_DMA_FIRST_ONESHOT(_table, _n) ((_table)[0])
+#define PWM_DMA_FIRST_REPEAT(_table, _n)  ((_table)[(_n) - 1])
+#define PWM_DMA_SRC_ONESHOT(_table)       ((_table) + 1)
+#define PWM_DMA_SRC_REPEAT(_table)        (_table)
+#define PWM_DMA_LEN_ONESHOT(_n)           ((_n) - 1)
+#define PWM_DMA_LEN_REPEAT(_n)            (_n)
+
+// Set up a DMA descriptor to stream n compare values for Timer 1 channel ch (1 or 2).
+// _repeat is REPEAT or ONESHOT.
+#define pwm_dma_setup(_conf, _ch, _table, _n, _repeat)                         \
+	do {                                                                       \
+		(_conf)->src = SWAP16((uint16_t)PWM_DMA_SRC_##_repeat(_table));        \
+		(_conf)->dst = SWAP16(TIMER1_T1CC_XADDR(_ch));                         \
+		(_conf)->len = DMA_LEN(PWM_DMA_LEN_##_repeat(_n), FIXED);              \
+		(_conf)->mode1 = DMA_MODE1(TRIG_T1_CH##_ch, BYTEMODE, _repeat, WORD16); \
+		(_conf)->mode2 = DMA_MODE2(PRIORITY_HIGH, NO_MASK8, INTR_DISABLE,      \
+		                           SRC_INC_1, DST_CONST);                      \
+	} while (0)
+
+// Start Timer 1 with the given period (in ticks / divider), with the table set
+// up by pwm_dma_setup(). The DMA channel must already be armed.
+#define pwm_dma_start(_ch, _div, _period, _table, _n, _repeat)                 \
+	do {                                                                       \
+		T1CTL = T1CTL_MODE_SUSPEND;                                            \
+		T1CNTL = 0;                                                            \
+		TIMER1.t1cc0 = (_period) - 1;                                          \
+		TIMER1.t1cc##_ch = PWM_DMA_FIRST_##_repeat(_table, _n);                \
+		T1CCTL##_ch = T1CCTL##_ch##_MODE | T1CCTL##_ch##_CMP_CLR_ON_CMP_UP;    \
+		T1CTL = T1CTL_MODE_MODULO | T1CTL_DIV_##_div;                          \
+	} while (0)
+
+#define pwm_dma_stop()                                                         \
+	do {                                                                       \
+		T1CTL = T1CTL_MODE_SUSPEND;                                            \
+	} while (0)
+
+// WS2812-style bit streams: 1.25 us bits at 32 MHz (DIV1, TICKSPD 32 MHz).
+#define PWM_WS2812_PERIOD 40u
+#define PWM_WS2812_T0H    13u   // 0.4 us
+#define PWM_WS2812_T1H    26u   // 0.8 us
+
+// Low time that latches the data, in entries of 0 (no high time). Covers the
+// reset gap in repeated mode as well, where the table starts over after it.
+#ifndef PWM_WS2812_RESET_US
+#define PWM_WS2812_RESET_US 50u
+#endif
+#define PWM_WS2812_RESET_ENTRIES ((PWM_WS2812_RESET_US * 4u + 4u) / 5u)
+
+// Table entries for n bytes, including the reset gap
+#define PWM_WS2812_ENTRIES(_n) (8u * (_n) + PWM_WS2812_RESET_ENTRIES)
+
+// Encode n bytes (GRB order, MSB first) as compare values, 8 per byte, followed
+// by the reset gap: PWM_WS2812_ENTRIES(n) entries in all.
+inline void
+pwm_dma_ws2812_encode(uint16_t __xdata * dst, const uint8_t * src, uint16_t n)
+{
+	while (n--) {
+		uint8_t b = *src++;
+		uint8_t i;
+
+		for (i = 0; i < 8; i++) {
+			*dst++ = (b & 0x80) ? PWM_WS2812_T1H : PWM_WS2812_T0H;
+			b <<= 1;
+		}
+	}
+	for (n = 0; n < PWM_WS2812_RESET_ENTRIES; n++)
+		*dst++ = 0;
+}
+
+// Servo pulses: 20 ms period, 1-2 ms pulses, with DIV128 at TICKSPD 32 MHz (250 kHz)
+#define PWM_SERVO_PERIOD 5000u
+#define PWM_SERVO_US(_us) ((uint16_t)((_us) / 4u))
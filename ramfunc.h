@@ -0,0 +1,92 @@
+// SPDX-FileCopyrightText: 2023 Andreas Sig Rosvall
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+#include <compiler.h>
+#include <stdint.h>
+#include "bits.h"
+#include "mem.h"
+
+/*
+ * Execute code from SRAM.
+ *
+ * With MEMCTR_XMAP set, SRAM xdata 0x0000-(SRAM size - 1) also appears in code
+ * space at 0x8000 and up. Code running there has deterministic fetch timing (no
+ * flash cache misses) and keeps running while the flash is being erased or
+ * programmed.
+ *
+ * Functions to run from SRAM go in source files starting with
+ *
+ *   #pragma codeseg RAMFUNC
+ *
+ * and the RAMFUNC segment is linked at its execution address, with the xdata it
+ * occupies kept away from the compiler:
+ *
+ *   --xram-size <RAMFUNC_XDATA_ADDR> -Wl-bRAMFUNC=<XMAP_CODE_ADDR(RAMFUNC_XDATA_ADDR)>
+ *
+ * The linker then places the image at the same address in flash, that is in
+ * bank 1 at offset RAMFUNC_XDATA_ADDR, from where ramfunc_load() copies it to
+ * SRAM at boot. Absolute jumps and calls within the segment are correct for the
+ * SRAM copy, and calls out of it to root bank code work as usual.
+ *
+ * Since MEMCTR_XMAP hides the upper code bank, XMAP must stay set for as long as
+ * SRAM code may run. Interrupt handlers in the RAMFUNC segment (their vectors jump
+ * to the SRAM copy) need it set permanently, which is only possible when no other
+ * code lives above 0x8000. Otherwise, call SRAM functions through RAMFUNC_CALL(),
+ * from the root bank, with interrupts that may vector to banked code disabled.
+ */
+
+// SRAM reserved for code. The default leaves the top 256 bytes, where the 8051 data
+// space is mapped (see mmap_idata_to_xdata()), to the stack and registers.
+#ifndef RAMFUNC_XDATA_ADDR
+#define RAMFUNC_XDATA_ADDR 0x1C00u
+#endif
+#ifndef RAMFUNC_SIZE
+#define RAMFUNC_SIZE 0x0300u
+#endif
+
+// Flash bank the linker puts code linked at 0x8000-0xFFFF in (for non-banked images)
+#define RAMFUNC_IMAGE_BANK 1
+
+// Copy the RAMFUNC image from flash to SRAM. Call at boot, before any SRAM code runs.
+inline void
+ramfunc_load(void)
+{
+	uint8_t memctr = MEMCTR;
+	const uint8_t __xdata * src = (const uint8_t __xdata *)XMAP_CODE_ADDR(RAMFUNC_XDATA_ADDR);
+	uint8_t __xdata * dst = (uint8_t __xdata *)RAMFUNC_XDATA_ADDR;
+	uint16_t n = RAMFUNC_SIZE;
+
+	// Don't run this with XMAP set: the image would be copied onto itself
+	MEMCTR = (memctr & ~(MEMCTR_XBANK__MASK | MEMCTR_XMAP)) | RAMFUNC_IMAGE_BANK;
+	while (n--)
+		*dst++ = *src++;
+	MEMCTR = memctr;
+}
+
+// Map SRAM into code space permanently. Only for images without code above 0x8000.
+#define ramfunc_enable()                                                       \
+	do {                                                                       \
+		MEMCTR |= MEMCTR_XMAP;                                                 \
+	} while (0)
+
+#define ramfunc_disable()                                                      \
+	do {                                                                       \
+		MEMCTR &= ~MEMCTR_XMAP;                                                \
+	} while (0)
+
+// Call an SRAM function, mapping SRAM into code space for the duration of the call.
+// _call is the complete call expression, e.g. RAMFUNC_CALL(radio_rx_copy(buf, len)).
+#define RAMFUNC_CALL(_call)                                                    \
+	do {                                                                       \
+		uint8_t _memctr = MEMCTR;                                              \
+		MEMCTR = _memctr | MEMCTR_XMAP;                                        \
+		_call;                                                                 \
+		MEMCTR = _memctr;                                                      \
+	} while (0)
+
+// True if a function (or code address) is in the SRAM code window
+#define ramfunc_contains(_fn)                                                  \
+	((uint16_t)(_fn) >= XMAP_CODE_ADDR(RAMFUNC_XDATA_ADDR)                     \
+	 && (uint16_t)(_fn) < XMAP_CODE_ADDR(RAMFUNC_XDATA_ADDR + RAMFUNC_SIZE))
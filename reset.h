@@ -0,0 +1,172 @@
+// SPDX-FileCopyrightText: 2023 Andreas Sig Rosvall
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+#include <compiler.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "bits.h"
+#include "overlay.h"
+#include "sleep.h"
+#include "watchdog.h"
+
+/*
+ * Reset cause and crash context.
+ *
+ * SRAM keeps its contents across watchdog, external and clock loss resets, so a
+ * record at a fixed xdata address that the startup code does not clear survives
+ * them. While running, it holds:
+ *
+ *   - the PC and SP last sampled by a periodic interrupt, so after a watchdog
+ *     reset it shows where the CPU was stuck (within one sample period)
+ *   - the last ISR entered, for ISRs marked with RESET_ISR()
+ *   - the site of the last watchdog feed, for feeds through reset_watchdog_feed()
+ *
+ * At boot, reset_init() reads the cause from SLEEPSTA, copies the record of the
+ * previous run into the caller's struct reset_stats and starts a new one. Reset
+ * counts per cause are kept in the record as well, until a power-on reset.
+ *
+ * The record must be kept out of the linker's xdata, e.g. with --xram-size
+ * 0x1EE0 for the default RESET_RECORD_ADDR, and below the idata mapping at the
+ * top of SRAM (see mmap_idata_to_xdata()), where the stack would overwrite it.
+ *
+ * To sample the PC, define RESET_SAMPLE_VECTOR (e.g. INTR_T3) and
+ * RESET_SAMPLE_HANDLER (the assembler name of the real handler, e.g.
+ * _timer3_isr, declared __interrupt without a number) in exactly one
+ * translation unit before including this file. Its interrupt entry then stores
+ * the PC and SP and jumps to the handler.
+ */
+
+#ifndef RESET_RECORD_ADDR
+#define RESET_RECORD_ADDR 0x1EE0
+#endif
+
+#define RESET_RECORD_MAGIC 0xC4A5u
+
+// Identifies the file in feed sites; define before including, 0-15
+#ifndef RESET_FILE_ID
+#define RESET_FILE_ID 0
+#endif
+
+struct reset_record {
+	uint16_t magic;
+	uint16_t pc;          // Offset 2, written by the sampling interrupt
+	uint8_t sp;           // Offset 4, written by the sampling interrupt
+	uint8_t isr;          // Last ISR entered, RESET_ISR_NONE when none
+	uint16_t feed_site;   // RESET_FILE_ID << 12 | line of the last feed
+	uint16_t feeds;       // Watchdog feeds in this run
+	uint16_t resets[4];   // Resets by enum sleepsta_rst since power-on
+};
+
+_Static_assert(offsetof(struct reset_record, pc) == 2 && offsetof(struct reset_record, sp) == 4,
+               "reset_sample_isr() writes pc and sp at fixed offsets");
+_Static_assert(RESET_RECORD_ADDR + sizeof(struct reset_record) <= OVERLAY_XDATA_END,
+               "reset_record overlaps the idata mapping");
+
+__xdata __at(RESET_RECORD_ADDR) struct reset_record reset_record;
+
+#define RESET_ISR_NONE 0xFF
+
+struct reset_stats {
+	uint8_t cause;        // enum sleepsta_rst of the last reset
+	uint8_t valid;        // Nonzero if the fields below are from the previous run
+	uint16_t pc;
+	uint8_t sp;
+	uint8_t isr;
+	uint16_t feed_site;
+	uint16_t feeds;
+	uint16_t resets[4];
+};
+
+#define reset_cause() ((SLEEPSTA & SLEEPSTA_RST__MASK) >> SLEEPSTA_RST__SHIFT)
+
+// Call first thing at boot
+inline void
+reset_init(struct reset_stats __xdata * stats)
+{
+	struct reset_record __xdata * r = &reset_record;
+	uint8_t cause = reset_cause();
+	uint8_t i;
+
+	stats->cause = cause;
+	// SRAM contents are undefined after power-on
+	stats->valid = cause != SLEEPSTA_RST_POWER && r->magic == RESET_RECORD_MAGIC;
+	if (!stats->valid) {
+		for (i = 0; i < 4; i++)
+			r->resets[i] = 0;
+	}
+	if (r->resets[cause] != 0xFFFF)
+		r->resets[cause]++;
+
+	stats->pc = r->pc;
+	stats->sp = r->sp;
+	stats->isr = r->isr;
+	stats->feed_site = r->feed_site;
+	stats->feeds = r->feeds;
+	for (i = 0; i < 4; i++)
+		stats->resets[i] = r->resets[i];
+
+	r->pc = 0;
+	r->sp = 0;
+	r->isr = RESET_ISR_NONE;
+	r->feed_site = 0;
+	r->feeds = 0;
+	r->magic = RESET_RECORD_MAGIC;
+}
+
+// Put first in ISRs to record them as the last one entered. _id is chosen by
+// the application, e.g. its INTR_ number.
+#define RESET_ISR(_id)                                                         \
+	do {                                                                       \
+		reset_record.isr = (_id);                                              \
+	} while (0)
+
+#define RESET_FEED_SITE (((uint16_t)RESET_FILE_ID << 12) | (__LINE__ & 0xFFF))
+
+// watchdog_feed(), recording where it was fed from
+#define reset_watchdog_feed()                                                  \
+	do {                                                                       \
+		reset_record.feed_site = RESET_FEED_SITE;                              \
+		reset_record.feeds++;                                                  \
+		watchdog_feed();                                                       \
+	} while (0)
+
+#ifdef RESET_SAMPLE_VECTOR
+
+// The interrupt pushed the PC, low byte first. After the five pushes here it
+// is at SP-5 (high) and SP-6 (low), and the SP before the interrupt is SP-7.
+void
+reset_sample_isr(void) __interrupt(RESET_SAMPLE_VECTOR) __naked
+{
+	__asm
+	push	acc
+	push	dpl
+	push	dph
+	push	psw
+	mov	psw,#0          ; register bank 0, for ar0
+	push	ar0
+	mov	a,sp
+	add	a,#0xfb         ; sp - 5
+	mov	r0,a
+	mov	a,@r0           ; pc high
+	mov	dptr,#(RESET_RECORD_ADDR + 3)
+	movx	@dptr,a
+	dec	r0
+	mov	a,@r0           ; pc low
+	mov	dptr,#(RESET_RECORD_ADDR + 2)
+	movx	@dptr,a
+	dec	r0
+	mov	a,r0            ; sp before the interrupt
+	mov	dptr,#(RESET_RECORD_ADDR + 4)
+	movx	@dptr,a
+	pop	ar0
+	pop	psw
+	pop	dph
+	pop	dpl
+	pop	acc
+	ljmp	RESET_SAMPLE_HANDLER
+	__endasm;
+}
+
+#endif
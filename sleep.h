@@ -4,6 +4,8 @@
 
 #pragma once
 #include <compiler.h>
+#include "bits.h"
+#include "interrupts.h"
 
 SFR(PCON, 0x87); // Power Mode Control
 // (reset=0 R0/W) Power mode control. Writing 1 to this bit forces the device to enter the power mode
@@ -31,6 +33,17 @@ SFR(SLEEPCMD, 0xBE); // Sleep-Mode Control Command
 // (reset=0 R/W) Disable 32-kHz RC oscillator calibration 
 #define SLEEPCMD_OSC32K_CALDIS (BIT(7) | SLEEPCMD_RES1)
 
+// Enter power mode SLEEPCMD_MODE_##_mode until an interrupt wakes the chip.
+// Call with interrupts disabled, after checking that there is nothing to do:
+// the instruction following the one that sets EA is always executed before any
+// interrupt is serviced, so a wakeup cannot be missed between the check and PCON.
+#define sleep_enter(_mode)                                                     \
+	do {                                                                       \
+		SLEEPCMD = (SLEEPCMD & ~MASK_SLEEPCMD_MODE) | SLEEPCMD_MODE_##_mode;   \
+		IEN0_EA = 1;                                                           \
+		PCON = PCON_IDLE;                                                      \
+	} while (0)
+
 
 
 SFR(SLEEPSTA, 0x9D); // Sleep-Mode Control Status
@@ -3,7 +3,58 @@
 // SPDX-License-Identifier: GPL-3.0-or-later
 
 #pragma once
+#include <compiler.h>
 #include <stdint.h>
+#include "bits.h"
+#include "sleep.h"
+
+/*
+ * The sleep timer is a 24-bit counter clocked at 32 kHz that keeps running in
+ * all power modes except PM3. The compare value (written through ST2:ST1:ST0)
+ * raises INTR_ST and wakes the chip from PM1 and PM2.
+ */
+
+#define SLEEP_TIMER_HZ 32768ul
+#define SLEEP_TIMER_MASK 0xFFFFFFul
+
+SFR(ST0, 0x95); // Sleep Timer 0
+SFR(ST1, 0x96); // Sleep Timer 1
+SFR(ST2, 0x97); // Sleep Timer 2
+
+SFR(STLOAD, 0xAD); // Sleep Timer Load Status
+// (reset=1 R) 0: Load in progress, 1: New compare value may be written
+#define STLOAD_LDRDY BIT(0)
+
+// Wait for a rising edge of the 32 kHz clock. Must be done before reading the
+// sleep timer after waking from PM1 or PM2.
+#define sleep_timer_wait_edge()                                                \
+	do {                                                                       \
+		while (SLEEPSTA & SLEEPSTA_CLK32K);                                    \
+		while (!(SLEEPSTA & SLEEPSTA_CLK32K));                                 \
+	} while (0)
+
+// Reading ST0 latches ST1 and ST2, so ST0 must be read first.
+inline uint32_t
+sleep_timer_read(void)
+{
+	uint8_t l = ST0;
+	uint8_t m = ST1;
+
+	return ((uint32_t)ST2 << 16) | ((uint16_t)m << 8) | l;
+}
+
+// Writing ST0 loads the compare value, so ST0 must be written last.
+inline void
+sleep_timer_set_compare(uint32_t t)
+{
+	while (!(STLOAD & STLOAD_LDRDY));
+	ST2 = t >> 16;
+	ST1 = t >> 8;
+	ST0 = t;
+}
+
+// Ticks from a to b, modulo the timer width
+#define sleep_timer_diff(_a, _b) (((_b) - (_a)) & SLEEP_TIMER_MASK)
 
 __xdata __at(0x62B0) struct {
 
@@ -0,0 +1,99 @@
+// SPDX-FileCopyrightText: 2023 Andreas Sig Rosvall
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+#include <compiler.h>
+#include <stdint.h>
+#include "bits.h"
+
+/*
+ * Stack and memory usage measurement.
+ *
+ * The 8051 stack grows upwards in idata, from SP at startup to at most 0xFF.
+ * stack_paint() fills the unused part with a pattern early at boot, and
+ * stack_high_water() later finds the highest byte that has been overwritten,
+ * i.e. the deepest the stack has been. The same works for xdata buffers and
+ * pools with mem_paint() and mem_high_water().
+ *
+ * A full scan takes a while, so run it from the main loop, e.g. once a second
+ * with stack_sample(), and read the results from struct mem_stats. A cheap
+ * check for the ISR that fires most often is STACK_SAMPLE_SP(), which only
+ * records SP as seen in the handler.
+ *
+ * Once the top byte of idata has been overwritten (stack_overflowed()), the
+ * stack is about to wrap around into the registers. Check it before feeding the
+ * watchdog to turn an overflow into a clean reset instead of random behaviour.
+ */
+
+SFR(SP, 0x81); // Stack Pointer
+
+#define STACK_PAINT 0xA5
+#define STACK_TOP   0xFF
+
+struct mem_stats {
+	uint8_t stack_bottom;  // SP when painted
+	uint8_t stack_max;     // Highest stack address used
+	uint8_t sp_max;        // Highest SP seen by STACK_SAMPLE_SP()
+	uint16_t samples;
+};
+
+// Fill idata above SP with STACK_PAINT. Call early at boot, from main().
+inline void
+stack_paint(struct mem_stats * stats)
+{
+	uint8_t i = SP;
+
+	stats->stack_bottom = i;
+	stats->stack_max = i;
+	stats->sp_max = i;
+	stats->samples = 0;
+	while (i != STACK_TOP)
+		*(uint8_t __idata *)++i = STACK_PAINT;
+}
+
+// Highest idata address written since stack_paint()
+inline uint8_t
+stack_high_water(uint8_t bottom)
+{
+	uint8_t i = STACK_TOP;
+
+	while (i > bottom && *(const uint8_t __idata *)i == STACK_PAINT)
+		i--;
+	return i;
+}
+
+#define stack_overflowed() (*(const uint8_t __idata *)STACK_TOP != STACK_PAINT)
+
+// Bytes of stack never used
+#define stack_free(_stats) (STACK_TOP - (_stats)->stack_max)
+
+// Record SP, e.g. in a frequent interrupt handler
+#define STACK_SAMPLE_SP(_stats)                                                \
+	do {                                                                       \
+		if (SP > (_stats)->sp_max)                                             \
+			(_stats)->sp_max = SP;                                             \
+	} while (0)
+
+inline void
+stack_sample(struct mem_stats * stats)
+{
+	stats->stack_max = stack_high_water(stats->stack_bottom);
+	stats->samples++;
+}
+
+inline void
+mem_paint(uint8_t __xdata * p, uint16_t n)
+{
+	while (n--)
+		*p++ = STACK_PAINT;
+}
+
+// Bytes from the start of a painted buffer up to and including the last one written
+inline uint16_t
+mem_high_water(const uint8_t __xdata * p, uint16_t n)
+{
+	while (n && p[n - 1] == STACK_PAINT)
+		n--;
+	return n;
+}
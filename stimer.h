@@ -0,0 +1,241 @@
+// SPDX-FileCopyrightText: 2023 Andreas Sig Rosvall
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+#include <compiler.h>
+#include <stdint.h>
+#include "bits.h"
+#include "interrupts.h"
+#include "sleep.h"
+#include "sleep_timer.h"
+
+/*
+ * Tickless software timers on the sleep timer.
+ *
+ * Timers are kept in a hashed timing wheel: STIMER_SLOTS lists indexed by bits of
+ * the deadline, so starting and cancelling a timer is O(1). The sleep timer
+ * compare is always set to the nearest deadline, and there are no periodic
+ * ticks, so between timers the chip can stay in PM2:
+ *
+ *   void st_isr(void) __interrupt(INTR_ST) { stimer_dispatch(&timers); }
+ *
+ *   stimer_init(&timers);
+ *   stimer_start(&timers, TMR_LED, STIMER_MS(500), led_toggle);
+ *   for (;;) {
+ *       interrupts_disable();
+ *       if (!work_pending())
+ *           sleep_enter(PM2);
+ *       interrupts_enable();
+ *       do_work();
+ *   }
+ *
+ * Timers are identified by a small number chosen by the application. Callbacks
+ * run in the INTR_ST handler and may start or cancel any timer, including their
+ * own. Deadlines are 24-bit sleep timer values, so a timer can be at most 2^23
+ * ticks (256 s) away.
+ */
+
+#ifndef STIMER_MAX
+#define STIMER_MAX 8
+#endif
+#define STIMER_SLOTS 32
+// Sleep timer ticks per slot (2^6 ticks, about 2 ms)
+#ifndef STIMER_SLOT_SHIFT
+#define STIMER_SLOT_SHIFT 6
+#endif
+// The compare must be set at least this far ahead of the timer to fire reliably
+#define STIMER_MIN_TICKS 5
+#define STIMER_NONE 0xFF
+
+#define STIMER_MS(_ms) (((uint32_t)(_ms) * 4096u + 62) / 125)
+
+typedef void (*stimer_fn)(uint8_t id);
+
+struct stimer_wheel {
+	uint32_t deadline[STIMER_MAX];
+	stimer_fn fn[STIMER_MAX];
+	uint8_t next[STIMER_MAX];
+	uint8_t prev[STIMER_MAX];
+	uint8_t slot[STIMER_MAX];      // STIMER_NONE when not running
+	uint8_t head[STIMER_SLOTS];
+	uint32_t occupied;             // Bit per non-empty slot
+	uint32_t last;                 // Sleep timer at the last dispatch
+	uint32_t armed;                // Compare value, if is_armed
+	uint8_t is_armed;
+};
+
+#define stimer_slot_of(_t) ((uint8_t)((_t) >> STIMER_SLOT_SHIFT) & (STIMER_SLOTS - 1))
+#define stimer_running(_w, _id) ((_w)->slot[_id] != STIMER_NONE)
+// Deadline at or before now
+#define stimer_due(_deadline, _now) (sleep_timer_diff(_deadline, _now) < 0x800000ul)
+
+inline void
+stimer_init(struct stimer_wheel __xdata * w)
+{
+	uint8_t i;
+
+	for (i = 0; i < STIMER_MAX; i++)
+		w->slot[i] = STIMER_NONE;
+	for (i = 0; i < STIMER_SLOTS; i++)
+		w->head[i] = STIMER_NONE;
+	w->occupied = 0;
+	w->is_armed = 0;
+	w->last = sleep_timer_read();
+
+	IRCON_STIF = 0;
+	IEN0_STIE = 1;
+}
+
+inline void
+stimer_link(struct stimer_wheel __xdata * w, uint8_t id)
+{
+	uint8_t s = stimer_slot_of(w->deadline[id]);
+	uint8_t h = w->head[s];
+
+	w->next[id] = h;
+	w->prev[id] = STIMER_NONE;
+	if (h != STIMER_NONE)
+		w->prev[h] = id;
+	w->head[s] = id;
+	w->slot[id] = s;
+	w->occupied |= 1ul << s;
+}
+
+inline void
+stimer_unlink(struct stimer_wheel __xdata * w, uint8_t id)
+{
+	uint8_t s = w->slot[id];
+	uint8_t n = w->next[id];
+	uint8_t p = w->prev[id];
+
+	if (p != STIMER_NONE)
+		w->next[p] = n;
+	else if ((w->head[s] = n) == STIMER_NONE)
+		w->occupied &= ~(1ul << s);
+	if (n != STIMER_NONE)
+		w->prev[n] = p;
+	w->slot[id] = STIMER_NONE;
+}
+
+inline void
+stimer_arm(struct stimer_wheel __xdata * w, uint32_t t, uint32_t now)
+{
+	if (stimer_due(t, now) || sleep_timer_diff(now, t) < STIMER_MIN_TICKS)
+		t = (now + STIMER_MIN_TICKS) & SLEEP_TIMER_MASK;
+	sleep_timer_set_compare(t);
+	w->armed = t;
+	w->is_armed = 1;
+}
+
+// Start (or restart) timer id to call fn after ticks sleep timer ticks
+inline void
+stimer_start(struct stimer_wheel __xdata * w, uint8_t id, uint32_t ticks, stimer_fn fn)
+{
+	uint8_t ea = IEN0_EA;
+	uint32_t now, t;
+
+	IEN0_EA = 0;
+	if (stimer_running(w, id))
+		stimer_unlink(w, id);
+
+	now = sleep_timer_read();
+	t = (now + ticks) & SLEEP_TIMER_MASK;
+	w->deadline[id] = t;
+	w->fn[id] = fn;
+	stimer_link(w, id);
+
+	if (!w->is_armed || sleep_timer_diff(now, t) < sleep_timer_diff(now, w->armed))
+		stimer_arm(w, t, now);
+	IEN0_EA = ea;
+}
+
+// Stop a timer. The compare is left as is; an early wakeup is harmless.
+inline void
+stimer_cancel(struct stimer_wheel __xdata * w, uint8_t id)
+{
+	uint8_t ea = IEN0_EA;
+
+	IEN0_EA = 0;
+	if (stimer_running(w, id))
+		stimer_unlink(w, id);
+	IEN0_EA = ea;
+}
+
+// Find the nearest deadline. Returns 0 if no timer is running.
+// Slots are visited in time order from now, and the search stops as soon as no
+// later slot can hold an earlier deadline, so it usually looks at one slot.
+inline uint8_t
+stimer_next_deadline(struct stimer_wheel __xdata * w, uint32_t now, uint32_t * deadline)
+{
+	uint32_t best = SLEEP_TIMER_MASK;
+	uint8_t start = stimer_slot_of(now);
+	uint8_t found = 0;
+	uint8_t i, id;
+
+	for (i = 0; i < STIMER_SLOTS && w->occupied; i++) {
+		uint8_t s = (start + i) & (STIMER_SLOTS - 1);
+
+		if (!(w->occupied & (1ul << s)))
+			continue;
+		for (id = w->head[s]; id != STIMER_NONE; id = w->next[id]) {
+			uint32_t rel = stimer_due(w->deadline[id], now) ? 0 : sleep_timer_diff(now, w->deadline[id]);
+
+			if (rel <= best) {
+				best = rel;
+				*deadline = w->deadline[id];
+				found = 1;
+			}
+		}
+		if (found && best <= ((uint32_t)i << STIMER_SLOT_SHIFT))
+			break;
+	}
+	return found;
+}
+
+// Run expired timers and set the compare for the next one. Call from the INTR_ST handler.
+inline void
+stimer_dispatch(struct stimer_wheel __xdata * w)
+{
+	uint32_t now, t;
+	uint8_t n, s, id;
+
+	IRCON_STIF = 0;
+	w->is_armed = 0;
+	sleep_timer_wait_edge();
+
+	for (;;) {
+		now = sleep_timer_read();
+
+		// Slots passed since the last dispatch
+		if (sleep_timer_diff(w->last, now) >= ((uint32_t)STIMER_SLOTS << STIMER_SLOT_SHIFT))
+			n = STIMER_SLOTS;
+		else
+			n = ((stimer_slot_of(now) - stimer_slot_of(w->last)) & (STIMER_SLOTS - 1)) + 1;
+		s = stimer_slot_of(w->last);
+		w->last = now;
+
+		while (n--) {
+			// Callbacks may change the list, so start over after each one
+			id = w->head[s];
+			while (id != STIMER_NONE) {
+				if (stimer_due(w->deadline[id], now)) {
+					stimer_unlink(w, id);
+					w->fn[id](id);
+					id = w->head[s];
+				} else {
+					id = w->next[id];
+				}
+			}
+			s = (s + 1) & (STIMER_SLOTS - 1);
+		}
+
+		if (!stimer_next_deadline(w, now, &t))
+			return;
+		now = sleep_timer_read();
+		if (!stimer_due(t, now)) {
+			stimer_arm(w, t, now);
+			return;
+		}
+	}
+}
@@ -0,0 +1,245 @@
+// SPDX-FileCopyrightText: 2023 Andreas Sig Rosvall
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+#include <compiler.h>
+#include <stdint.h>
+#include "bits.h"
+#include "timer1.h"
+
+/*
+ * Pulse train measurement with Timer 1 input capture.
+ *
+ * Timer 1 runs free (0x0000-0xFFFF) and one of its channels captures the counter on
+ * rising edges or on all edges. The capture interrupt stores each value in a
+ * ring of 16-bit time stamps, which costs a few instructions per edge; the
+ * statistics are computed outside the interrupt.
+ *
+ * Drained edges are fed to t1_capture_edge(), which accumulates period,
+ * high time and jitter statistics over any number of batches:
+ *
+ *   t1_capture_ring_init(&ring, buf, 64);
+ *   t1_capture_start(1, ANY_EDGE, DIV1);
+ *   t1_capture_reset(&stats, T1_CAPTURE_ANY_EDGE | (P0_3 ? T1_CAPTURE_HIGH : 0));
+ *   ...
+ *   t1_capture_drain(&ring, &stats);
+ *
+ * and in the Timer 1 ISR: t1_capture_irq(&ring, 1);
+ *
+ * Periods must be shorter than 65536 timer ticks, and edges closer together
+ * than the interrupt latency are lost. Routing the channel to its pin (PERCFG,
+ * PxSEL) is left to the application.
+ */
+
+struct t1_capture_ring {
+	uint16_t __xdata * buf;
+	uint8_t mask;              // Capacity - 1, capacity a power of 2 up to 256
+	volatile uint8_t head;     // Written by t1_capture_irq() only
+	uint8_t tail;
+	volatile uint8_t overruns; // Edges dropped because the ring was full
+};
+
+// size: number of time stamps in buf, a power of 2 up to 256. One slot stays free.
+#define t1_capture_ring_init(_ring, _buf, _size)                               \
+	do {                                                                       \
+		(_ring)->buf = (_buf);                                                 \
+		(_ring)->mask = (uint8_t)((_size) - 1);                                \
+		(_ring)->head = 0;                                                     \
+		(_ring)->tail = 0;                                                     \
+		(_ring)->overruns = 0;                                                 \
+	} while (0)
+
+inline void
+t1_capture_push(struct t1_capture_ring __xdata * r, uint16_t t)
+{
+	uint8_t head = r->head;
+	uint8_t next = (head + 1) & r->mask;
+
+	if (next == r->tail) {
+		r->overruns++;
+		return;
+	}
+	r->buf[head] = t;
+	r->head = next;
+}
+
+// Call from the Timer 1 ISR. Stores a capture of channel _ch, if there is one.
+#define t1_capture_irq(_ring, _ch)                                             \
+	do {                                                                       \
+		if (T1STAT & T1STAT_CH##_ch##IF) {                                     \
+			uint8_t _l = T1CC##_ch##L;                                         \
+			uint16_t _t = ((uint16_t)T1CC##_ch##H << 8) | _l;                  \
+			T1STAT = ~T1STAT_CH##_ch##IF;                                      \
+			t1_capture_push(_ring, _t);                                        \
+		}                                                                      \
+	} while (0)
+
+// Start Timer 1 free-running with channel _ch capturing on _edge (RISING, FALLING,
+// ANY_EDGE) and interrupting on each capture. The overflow interrupt is disabled.
+#define t1_capture_start(_ch, _edge, _div)                                     \
+	do {                                                                       \
+		T1CTL = T1CTL_MODE_SUSPEND;                                            \
+		T1CCTL##_ch = T1CCTL##_ch##_CAP_##_edge | T1CCTL##_ch##_IM;            \
+		TIMIF_T1OVFIM = 0;                                                     \
+		T1STAT = ~T1STAT_CH##_ch##IF;                                          \
+		T1CNTL = 0;                                                            \
+		IEN1_T1IE = 1;                                                         \
+		T1CTL = T1CTL_MODE_FREE_RUNNING | T1CTL_DIV_##_div;                    \
+	} while (0)
+
+enum t1_capture_flags {
+	T1_CAPTURE_ANY_EDGE  = BIT(0), // Captures alternate between rising and falling edges
+	T1_CAPTURE_HIGH      = BIT(1), // Input level before the next edge (any-edge mode)
+	T1_CAPTURE_STARTED   = BIT(2), // last is valid
+	T1_CAPTURE_HAVE_HIGH = BIT(3), // high is valid
+};
+
+struct t1_capture_stats {
+	uint8_t flags;
+	uint16_t last;        // Last edge
+	uint16_t high;        // High time of the current period (any-edge mode)
+	uint16_t ref;         // First period, the reference for the jitter sums
+
+	uint16_t n;           // Complete periods
+	uint32_t period_sum;
+	uint32_t high_sum;    // Any-edge mode only
+	uint16_t period_min;
+	uint16_t period_max;
+	int32_t dev_sum;      // Sum of (period - ref)
+	uint32_t dev_sq_sum;  // Sum of (period - ref)^2, saturating
+};
+
+inline void
+t1_capture_reset(struct t1_capture_stats __xdata * s, uint8_t flags)
+{
+	s->flags = flags & (T1_CAPTURE_ANY_EDGE | T1_CAPTURE_HIGH);
+	s->n = 0;
+	s->period_sum = 0;
+	s->high_sum = 0;
+	s->period_min = 0xFFFF;
+	s->period_max = 0;
+	s->dev_sum = 0;
+	s->dev_sq_sum = 0;
+}
+
+inline void
+t1_capture_period(struct t1_capture_stats __xdata * s, uint16_t period)
+{
+	int16_t d;
+	uint32_t sq;
+
+	if (!s->n)
+		s->ref = period;
+	d = (int16_t)(period - s->ref);
+	sq = (uint32_t)((int32_t)d * d);
+
+	s->n++;
+	s->period_sum += period;
+	if (period < s->period_min)
+		s->period_min = period;
+	if (period > s->period_max)
+		s->period_max = period;
+	s->dev_sum += d;
+	s->dev_sq_sum = s->dev_sq_sum + sq < s->dev_sq_sum ? 0xFFFFFFFFul : s->dev_sq_sum + sq;
+}
+
+// Add one captured edge
+inline void
+t1_capture_edge(struct t1_capture_stats __xdata * s, uint16_t t)
+{
+	uint16_t delta = t - s->last;
+
+	s->last = t;
+	if (!(s->flags & T1_CAPTURE_STARTED)) {
+		s->flags |= T1_CAPTURE_STARTED;
+	} else if (!(s->flags & T1_CAPTURE_ANY_EDGE)) {
+		t1_capture_period(s, delta);
+	} else if (s->flags & T1_CAPTURE_HIGH) {
+		// Falling edge: end of the high time
+		s->high = delta;
+		s->flags |= T1_CAPTURE_HAVE_HIGH;
+	} else if (s->flags & T1_CAPTURE_HAVE_HIGH) {
+		// Rising edge: end of the period
+		s->high_sum += s->high;
+		t1_capture_period(s, s->high + delta);
+	}
+	if (s->flags & T1_CAPTURE_ANY_EDGE)
+		s->flags ^= T1_CAPTURE_HIGH;
+}
+
+// Add n captured edges
+inline void
+t1_capture_feed(struct t1_capture_stats __xdata * s, const uint16_t __xdata * ts, uint16_t n)
+{
+	while (n--)
+		t1_capture_edge(s, *ts++);
+}
+
+// Add the edges stored by t1_capture_irq(). After an overrun, the polarity of
+// edges in any-edge mode is unknown: reset the statistics with the input level.
+inline void
+t1_capture_drain(struct t1_capture_ring __xdata * r, struct t1_capture_stats __xdata * s)
+{
+	uint8_t tail = r->tail;
+
+	while (tail != r->head) {
+		t1_capture_edge(s, r->buf[tail]);
+		tail = (tail + 1) & r->mask;
+		r->tail = tail;
+	}
+}
+
+// Results. tick_hz is the timer tick rate (tick speed / divider).
+#define t1_capture_avg_period(_s) ((_s)->n ? (uint16_t)((_s)->period_sum / (_s)->n) : 0)
+#define t1_capture_freq_hz(_s, _tick_hz)                                       \
+	((_s)->n ? ((uint32_t)(_tick_hz) + t1_capture_avg_period(_s) / 2) / t1_capture_avg_period(_s) : 0)
+// Peak-to-peak period jitter in ticks
+#define t1_capture_jitter_pp(_s) ((_s)->n ? (_s)->period_max - (_s)->period_min : 0)
+
+// High time in 1/1000 of the period
+inline uint16_t
+t1_capture_duty_permille(const struct t1_capture_stats __xdata * s)
+{
+	uint32_t high = s->high_sum;
+	uint32_t period = s->period_sum;
+
+	while (high > 0x3FFFFF) {
+		high >>= 1;
+		period >>= 1;
+	}
+	return period ? high * 1000u / period : 0;
+}
+
+// Variance of the period in ticks^2
+inline uint32_t
+t1_capture_variance(const struct t1_capture_stats __xdata * s)
+{
+	int32_t mean;
+
+	if (s->n < 2)
+		return 0;
+	mean = s->dev_sum / (int32_t)s->n;
+	return s->dev_sq_sum / s->n - (uint32_t)(mean * mean);
+}
+
+// Integer square root, e.g. for the RMS jitter from t1_capture_variance()
+inline uint16_t
+t1_capture_isqrt(uint32_t x)
+{
+	uint32_t bit = 1ul << 30;
+	uint32_t r = 0;
+
+	while (bit > x)
+		bit >>= 2;
+	while (bit) {
+		if (x >= r + bit) {
+			x -= r + bit;
+			r = (r >> 1) + bit;
+		} else {
+			r >>= 1;
+		}
+		bit >>= 2;
+	}
+	return r;
+}
@@ -215,3 +215,14 @@ __xdata __at(0x62A3) struct {
 	/* Timer 1 channel 4 capture or compare value high-order byte. Writing to this register when T1CCTL4.MODE = 1 (compare mode) causes the T1CC4[15:0] update to the written value to be delayed until T1CNT = 0x0000.  (Reset=0x00) (R/W)*/ 
 	// __xdata __at(0x62AF) uint8_t t1cc4h;
 } TIMER1;
+
+// xdata address of T1CCn (n = 0-4), e.g. as a DMA source or destination
+#define TIMER1_T1CC_XADDR(_ch) (0x62A6u + 2u * (_ch))
+
+// Read the 16-bit counter. Reading T1CNTL latches T1CNTH, so the low byte must be read first.
+inline uint16_t
+timer1_read_count(void)
+{
+	uint8_t l = T1CNTL;
+	return ((uint16_t)T1CNTH << 8) | l;
+}
@@ -4,9 +4,8 @@
 
 #pragma once
 #include <compiler.h>
+#include "interrupts.h" // IEN1_T3IE, IRCON_T3IF
 
-SBIT(IEN1_T3IE, 0xB8, 3); // R/W Timer 3 interrupt enable
-SBIT(IRCON_T3IF, 0xC0, 3); // R/W/H0 Timer 3 interrupt flag. Set to 1 when Timer 3 interrupt occurs and cleared when CPU vectors to the interrupt service routine.
 SBIT(TIMIF_T3OVFIF, 0xD8, 0); // R/W0 Timer 3 overflow interrupt flag
 SBIT(TIMIF_T3CH0IF, 0xD8, 1); // R/W0 Timer 3 channel 0 interrupt flag
 SBIT(TIMIF_T3CH1IF, 0xD8, 2); // R/W0 Timer 3 channel 1 interrupt flag
@@ -5,9 +5,8 @@
 #pragma once
 #include <compiler.h>
 #include "bits.h"
+#include "interrupts.h" // IEN1_T4IE, IRCON_T4IF
 
-SBIT(IEN1_T4IE,     0xB8, 4); //  R/W    Timer 4 interrupt enable
-SBIT(IRCON_T4IF,    0xC0, 4); //  R/W/H0    Timer 4 interrupt flag. Set to 1 when Timer 4 interrupt occurs and cleared when CPU vectors to the interrupt service routine.
 SBIT(TIMIF_T4OVFIF, 0xD8, 3); //  R/W0   Timer 4 overflow interrupt flag
 SBIT(TIMIF_T4CH0IF, 0xD8, 4); //  R/W0   Timer 4 channel 0 interrupt flag
 SBIT(TIMIF_T4CH1IF, 0xD8, 5); //  R/W0   Timer 4 channel 1 interrupt flag
@@ -0,0 +1,89 @@
+#!/usr/bin/env python3
+# SPDX-FileCopyrightText: 2023 Andreas Sig Rosvall
+#
+# SPDX-License-Identifier: GPL-3.0-or-later
+
+"""Assign SDCC modules to code banks.
+
+Reads the code size of each module from its .rel file, keeps the modules
+listed with --hot in the root bank (HOME), and packs the rest into
+BANK1..BANKn, largest first. Prints a Makefile fragment with the
+--codeseg option for each module and the linker options placing the banks:
+
+    tools/bank_alloc.py --banks 7 --hot radio_isr.rel usb.rel -- build/*.rel > banks.mk
+
+Modules must then be recompiled with their --codeseg option, and banked
+functions declared __banked (see bank.h).
+"""
+
+import argparse
+import os
+import re
+import sys
+
+BANK_SIZE = 0x8000
+
+# A CSEG size 1A4 flags 0 addr 0
+AREA_RE = re.compile(r"^A\s+(\S+)\s+size\s+([0-9A-Fa-f]+)\s")
+CODE_AREA_RE = re.compile(r"^(CSEG|HOME|BANK\d+)$")
+
+
+def code_size(path):
+    size = 0
+    with open(path) as f:
+        for line in f:
+            m = AREA_RE.match(line)
+            if m and CODE_AREA_RE.match(m.group(1)):
+                size += int(m.group(2), 16)
+    return size
+
+
+def module_name(path):
+    return os.path.splitext(os.path.basename(path))[0]
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument("--banks", type=int, default=7, help="number of banks besides the root bank (default 7)")
+    ap.add_argument("--root-reserve", type=lambda s: int(s, 0), default=0x1000,
+                    help="bytes of the root bank kept free for vectors, startup code and libraries (default 0x1000)")
+    ap.add_argument("--hot", nargs="*", default=[], help="modules to keep in the root bank")
+    ap.add_argument("rel", nargs="+", help=".rel files")
+    args = ap.parse_args()
+
+    hot = {module_name(p) for p in args.hot}
+    modules = sorted(((code_size(p), module_name(p)) for p in args.rel), reverse=True)
+
+    root_free = BANK_SIZE - args.root_reserve
+    free = [BANK_SIZE] * (args.banks + 1)
+    free[0] = root_free
+    placement = {}
+
+    for size, name in modules:
+        if name in hot:
+            bank = 0
+            if size > free[0]:
+                sys.exit("hot module %s (%d bytes) does not fit in the root bank" % (name, size))
+        else:
+            bank = next((b for b in range(1, args.banks + 1) if free[b] >= size), None)
+            if bank is None:
+                sys.exit("module %s (%d bytes) does not fit in any bank" % (name, size))
+        free[bank] -= size
+        placement[name] = bank
+
+    print("# Generated by tools/bank_alloc.py")
+    for size, name in sorted(modules, key=lambda m: m[1]):
+        bank = placement[name]
+        seg = "HOME" if bank == 0 else "BANK%d" % bank
+        print("CODESEG_%s = --codeseg %s  # %d bytes" % (name, seg, size))
+
+    used = [b for b in range(1, args.banks + 1) if free[b] != BANK_SIZE]
+    print("BANK_LDFLAGS = %s" % " ".join("-Wl-bBANK%d=0x%X" % (b, (b << 16) | BANK_SIZE) for b in used))
+
+    print("# Root bank: %d bytes free" % free[0])
+    for b in used:
+        print("# BANK%d: %d bytes free" % (b, free[b]))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,85 @@
+#!/usr/bin/env python3
+# SPDX-FileCopyrightText: 2023 Andreas Sig Rosvall
+#
+# SPDX-License-Identifier: GPL-3.0-or-later
+
+"""Report RAM usage per SDCC module.
+
+Reads the size of each data area from the .rel files and prints a table of
+xdata (XSEG, XISEG, PSEG), internal data (DSEG, OSEG, ISEG, IABS) and bit
+(BSEG) usage per module, largest xdata users first, with totals:
+
+    tools/mem_report.py --xram-size 0x1F00 build/*.rel
+
+With --xram-size (and --iram-size), exits with an error if the totals exceed
+the given sizes, so the build fails instead of the stack or buffers silently
+overlapping. Remember that the top 256 bytes of SRAM hold the 8051 data space
+(see mmap_idata_to_xdata() in mem.h), and that the stack takes whatever idata
+is left (see stack.h).
+"""
+
+import argparse
+import os
+import re
+import sys
+
+# A XSEG size 80 flags 0 addr 0
+AREA_RE = re.compile(r"^A\s+(\S+)\s+size\s+([0-9A-Fa-f]+)\s")
+
+GROUPS = {
+    "xdata": ("XSEG", "XISEG", "PSEG"),
+    "idata": ("DSEG", "OSEG", "ISEG", "IABS"),
+    "bits": ("BSEG",),
+}
+
+
+def area_sizes(path):
+    sizes = {}
+    with open(path) as f:
+        for line in f:
+            m = AREA_RE.match(line)
+            if m:
+                sizes[m.group(1)] = sizes.get(m.group(1), 0) + int(m.group(2), 16)
+    return sizes
+
+
+def module_name(path):
+    return os.path.splitext(os.path.basename(path))[0]
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument("--xram-size", type=lambda s: int(s, 0), help="xdata available to the linker")
+    ap.add_argument("--iram-size", type=lambda s: int(s, 0), help="internal data available to variables")
+    ap.add_argument("rel", nargs="+", help=".rel files")
+    args = ap.parse_args()
+
+    rows = []
+    for path in args.rel:
+        sizes = area_sizes(path)
+        usage = {g: sum(sizes.get(a, 0) for a in areas) for g, areas in GROUPS.items()}
+        rows.append((module_name(path), usage))
+    rows.sort(key=lambda r: (-r[1]["xdata"], -r[1]["idata"], r[0]))
+
+    width = max([len(name) for name, _ in rows] + [6])
+    print("%-*s %6s %6s %5s" % (width, "module", "xdata", "idata", "bits"))
+    for name, usage in rows:
+        if any(usage.values()):
+            print("%-*s %6d %6d %5d" % (width, name, usage["xdata"], usage["idata"], usage["bits"]))
+
+    total = {g: sum(u[g] for _, u in rows) for g in GROUPS}
+    print("%-*s %6d %6d %5d" % (width, "total", total["xdata"], total["idata"], total["bits"]))
+
+    err = False
+    if args.xram_size is not None:
+        print("xdata: %d of %d bytes free" % (args.xram_size - total["xdata"], args.xram_size))
+        err |= total["xdata"] > args.xram_size
+    if args.iram_size is not None:
+        print("idata: %d of %d bytes free for the stack" % (args.iram_size - total["idata"], args.iram_size))
+        err |= total["idata"] > args.iram_size
+    if err:
+        sys.exit("RAM usage exceeds the available size")
+
+
+if __name__ == "__main__":
+    main()
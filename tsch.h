@@ -0,0 +1,266 @@
+// SPDX-FileCopyrightText: 2023 Andreas Sig Rosvall
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+#include <compiler.h>
+#include <stdint.h>
+#include "bits.h"
+#include "csp.h"
+#include "dma.h"
+#include "mac_timer.h"
+#include "mem.h"
+#include "radio.h"
+
+/*
+ * Time-slotted channel hopping (IEEE 802.15.4 TSCH) slot engine.
+ *
+ * Time is divided into slots of TSCH_SLOT_TICKS MAC timer ticks, numbered by
+ * the absolute slot number (ASN). A slotframe of sf_len slots repeats, and
+ * each slot position has at most one link (TX, RX or both when shared). The
+ * channel of a link is hopping[(ASN + channel offset) % hop_len].
+ *
+ * TSCH_PREP_TICKS before each slot, compare channel 2 of the MAC timer
+ * interrupts and tsch_irq() prepares the slot: it turns the radio off, sets
+ * FREQCTRL, hands the frame to send (if any) to DMA for the TX FIFO, or arms the
+ * same DMA channel to copy a received frame out of the RX FIFO, and loads a CSP
+ * program that waits for the exact slot offset and strobes TX or RX on:
+ *
+ *   WAITW(n)        ; to the MAC timer period of the action
+ *   WEVENT1         ; compare 1 = offset within that period (T2EVTCFG event 1)
+ *   STXON / SRXON
+ *
+ * so the radio timing does not depend on interrupt latency. Finding the link
+ * and the channel is O(1): the slotframe and hopping sequence positions are
+ * advanced with the ASN instead of being recomputed.
+ *
+ * A frame received in an RX slot is handed to the rx callback when the next
+ * slot is prepared, if the DMA has copied all of it by then (the channel is no
+ * longer armed). Acknowledgements are not handled.
+ *
+ * Slots are the standard 10 ms by default. They need not be a whole number of
+ * MAC timer periods, so the default 320 us period, which the rest of the MAC
+ * relies on, is kept.
+ */
+
+#ifndef TSCH_SLOTFRAME_MAX
+#define TSCH_SLOTFRAME_MAX 32
+#endif
+#ifndef TSCH_HOPPING_MAX
+#define TSCH_HOPPING_MAX 16
+#endif
+
+#define TSCH_US(_us) ((uint32_t)(_us) * 32u)
+#ifndef TSCH_SLOT_TICKS
+#define TSCH_SLOT_TICKS TSCH_US(10000)
+#endif
+
+// 802.15.4 default timeslot template: TX at 2120 us, RX on a guard time earlier
+#ifndef TSCH_TX_OFFSET
+#define TSCH_TX_OFFSET TSCH_US(2120)
+#endif
+#ifndef TSCH_RX_GUARD
+#define TSCH_RX_GUARD TSCH_US(1100)
+#endif
+#define TSCH_RX_OFFSET (TSCH_TX_OFFSET - TSCH_RX_GUARD)
+
+// Slot preparation lead. CSP WAITW can wait for at most 31 periods.
+#ifndef TSCH_PREP_TICKS
+#define TSCH_PREP_TICKS TSCH_US(1500)
+#endif
+
+_Static_assert(TSCH_PREP_TICKS + TSCH_TX_OFFSET < 31ul * MAC_TIMER_PERIOD,
+               "TSCH slot action too far from the preparation time for CSP WAITW");
+
+// Don't start a CSP wait this close to the end of a MAC timer period
+#define TSCH_PERIOD_MARGIN 64u
+
+enum tsch_link_opt {
+	TSCH_LINK_TX     = BIT(0),
+	TSCH_LINK_RX     = BIT(1),
+	TSCH_LINK_SHARED = BIT(2),
+};
+
+struct tsch_link {
+	uint8_t opt;          // enum tsch_link_opt, 0 for no link
+	uint8_t ch_offset;    // < hop_len
+};
+
+// Frame to send on a TX link, in TX FIFO format (length byte first), or NULL.
+typedef const uint8_t __xdata * (*tsch_tx_fn)(const struct tsch_link __xdata * link);
+// Frame received in slot asn, in RX FIFO format (length byte first, the FCS
+// replaced by the RSSI and CRC_OK/correlation bytes). Called from tsch_irq().
+typedef void (*tsch_rx_fn)(const uint8_t __xdata * frame, uint32_t asn);
+
+struct tsch {
+	uint32_t asn;                          // Next slot to prepare
+	struct mac_timer_time prep;            // When to prepare it (TSCH_PREP_TICKS before it starts)
+	uint8_t sf_len, sf_pos;                // sf_pos = asn % sf_len
+	uint8_t hop_len, hop_pos;              // hop_pos = asn % hop_len
+	uint8_t hopping[TSCH_HOPPING_MAX];     // 802.15.4 channels 11-26
+	struct tsch_link links[TSCH_SLOTFRAME_MAX];
+	tsch_tx_fn tx;
+	tsch_rx_fn rx;
+	uint8_t __xdata * rx_buf;              // 128 bytes, or NULL to not receive through DMA
+	struct dma_conf __xdata * dma;         // Channel used for the TX and RX FIFOs
+	uint8_t dma_ch;
+	uint8_t active;                        // enum tsch_link_opt of the current slot
+	uint32_t rx_asn;                       // Slot rx_buf is being received in
+};
+
+#define TSCH_FREQCTRL(_ch) (11 + 5 * ((_ch) - 11))
+
+#define tsch_set_link(_tsch, _slot, _opt, _ch_offset)                          \
+	do {                                                                       \
+		(_tsch)->links[_slot].opt = (_opt);                                    \
+		(_tsch)->links[_slot].ch_offset = (_ch_offset);                        \
+	} while (0)
+
+// Set up the DMA descriptor for copying a frame to the TX FIFO through RFD
+inline void
+tsch_dma_setup(struct dma_conf __xdata * conf, const uint8_t __xdata * frame)
+{
+	// The length byte counts the FCS, which the radio appends
+	conf->src = SWAP16((uint16_t)frame);
+	conf->dst = SWAP16(SFR_MAPPING_IN_XDATA + 0xD9);  // RFD
+	conf->len = DMA_LEN(frame[0] - 1, FIXED);
+	conf->mode1 = DMA_MODE1(TRIG_NONE, BLOCKMODE, ONESHOT, WORD8);
+	conf->mode2 = DMA_MODE2(PRIORITY_HIGH, NO_MASK8, INTR_DISABLE, SRC_INC_1, DST_CONST);
+}
+
+// Set up the DMA descriptor for copying a received frame from the RX FIFO, one
+// byte per RADIO trigger. The length byte gives the rest of the frame.
+inline void
+tsch_dma_setup_rx(struct dma_conf __xdata * conf, uint8_t __xdata * buf)
+{
+	conf->src = SWAP16(SFR_MAPPING_IN_XDATA + 0xD9);  // RFD
+	conf->dst = SWAP16((uint16_t)buf);
+	conf->len = DMA_LEN(128, PREFIX1);
+	conf->mode1 = DMA_MODE1(TRIG_RADIO, BYTEMODE, ONESHOT, WORD8);
+	conf->mode2 = DMA_MODE2(PRIORITY_HIGH, MASK8, INTR_DISABLE, SRC_CONST, DST_INC_1);
+}
+
+// Load and start the CSP program for an action at time at
+inline void
+tsch_csp_load(const struct mac_timer_time * at, uint8_t strobe)
+{
+	struct mac_timer_time now;
+	uint8_t sel = T2MSEL;
+	uint8_t n;
+
+	// Called from the T2 ISR, possibly in the middle of a foreground access
+	mac_timer_select_multiplexed_regs(T2M_CMP1, T2OVF_CMP1);
+	T2M0 = at->tim;
+	T2M1 = at->tim >> 8;
+	T2MSEL = sel;
+
+	// WAITW counts overflows from when it starts, so start it early in a period
+	do
+		mac_timer_read(&now);
+	while (now.tim >= MAC_TIMER_PERIOD - TSCH_PERIOD_MARGIN);
+	n = (at->ovf - now.ovf) & 0x1F;
+
+	RFST = CSP_CMD_CLEAR;
+	RFST = CSP_CMD_CLEAR;
+	if (n)
+		RFST = CSP_INSN_WAITW(n);
+	RFST = CSP_INSN_WEVENT1;
+	RFST = CSP_INSN_STROBE(strobe);
+	RFST = CSP_IMM_CMD_STROBE(CSP_CMD_START);
+}
+
+inline void
+tsch_advance(struct tsch __xdata * tsch)
+{
+	tsch->asn++;
+	if (++tsch->sf_pos == tsch->sf_len)
+		tsch->sf_pos = 0;
+	if (++tsch->hop_pos == tsch->hop_len)
+		tsch->hop_pos = 0;
+	mac_timer_add(&tsch->prep, TSCH_SLOT_TICKS);
+}
+
+// Schedule the preparation of the next slot, skipping slots that are already too late
+inline void
+tsch_schedule(struct tsch __xdata * tsch)
+{
+	while (mac_timer_schedule(2, &tsch->prep))
+		tsch_advance(tsch);
+}
+
+// Start with slot asn, beginning a little more than TSCH_PREP_TICKS from now.
+// sf_len, hop_len, hopping, links, tx, rx, rx_buf, dma and dma_ch must be set up, and the MAC
+// timer running (see mac_timer_start()). Compare channels 1 and 2 are used by
+// the slot engine.
+inline void
+tsch_start(struct tsch __xdata * tsch, uint32_t asn)
+{
+	mac_timer_read(&tsch->prep);
+	tsch->prep.ovf++;
+	tsch->prep.tim = 0;
+
+	tsch->asn = asn;
+	tsch->sf_pos = asn % tsch->sf_len;
+	tsch->hop_pos = asn % tsch->hop_len;
+	tsch->active = 0;
+
+	mac_timer_setup_event_pulses(CMP1, NONE);
+	tsch_schedule(tsch);
+}
+
+// Call from the T2 interrupt handler with the events from mac_timer_irq().
+inline void
+tsch_irq(struct tsch __xdata * tsch, uint8_t events)
+{
+	const struct tsch_link __xdata * link = &tsch->links[tsch->sf_pos];
+	const uint8_t __xdata * frame = 0;
+	struct mac_timer_time at;
+	uint8_t opt = link->opt;
+	uint8_t ch;
+
+	if (!(events & T2IRQ_COMPARE2))
+		return;
+
+	// The previous slot is over
+	RFST = CSP_IMM_CMD_STROBE(CSP_CMD_RFOFF);
+	if (tsch->active == TSCH_LINK_RX && tsch->rx_buf) {
+		if (!dma_is_armed(tsch->dma_ch)) {
+			if (tsch->rx)
+				tsch->rx(tsch->rx_buf, tsch->rx_asn);
+		} else {
+			dma_abort(tsch->dma_ch);
+		}
+	}
+
+	if ((opt & TSCH_LINK_TX) && tsch->tx)
+		frame = tsch->tx(link);
+	tsch->active = frame ? TSCH_LINK_TX : opt & TSCH_LINK_RX;
+
+	if (tsch->active) {
+		ch = tsch->hop_pos + link->ch_offset;
+		if (ch >= tsch->hop_len)
+			ch -= tsch->hop_len;
+		RADIO.freqctrl = TSCH_FREQCTRL(tsch->hopping[ch]);
+
+		at = tsch->prep;
+		mac_timer_add(&at, TSCH_PREP_TICKS + (frame ? TSCH_TX_OFFSET : TSCH_RX_OFFSET));
+
+		if (frame) {
+			// Arming takes a few cycles, flush the FIFO meanwhile
+			tsch_dma_setup(tsch->dma, frame);
+			dma_arm(tsch->dma_ch);
+			RFST = CSP_IMM_CMD_STROBE(CSP_CMD_FLUSHTX);
+			dma_trig(tsch->dma_ch);
+		} else if (tsch->rx_buf) {
+			// The first byte copied must be the length byte of the new frame
+			RFST = CSP_IMM_CMD_STROBE(CSP_CMD_FLUSHRX);
+			tsch_dma_setup_rx(tsch->dma, tsch->rx_buf);
+			dma_arm(tsch->dma_ch);
+			tsch->rx_asn = tsch->asn;
+		}
+		tsch_csp_load(&at, frame ? CSP_CMD_TXON : CSP_CMD_RXON);
+	}
+
+	tsch_advance(tsch);
+	tsch_schedule(tsch);
+}